@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <sys/mman.h>
+#include "allocator.h"
+
+/**
+ * malloc wrapper matching allocator_alloc.
+ */
+static void *std_alloc (size_t size, void *ctx)
+{
+  (void) ctx;
+  return malloc (size);
+}
+
+/**
+ * realloc wrapper matching allocator_realloc.
+ */
+static void *std_realloc (void *ptr, size_t old_size, size_t new_size,
+                          void *ctx)
+{
+  (void) old_size;
+  (void) ctx;
+  return realloc (ptr, new_size);
+}
+
+/**
+ * free wrapper matching allocator_free.
+ */
+static void std_free (void *ptr, size_t size, void *ctx)
+{
+  (void) size;
+  (void) ctx;
+  free (ptr);
+}
+
+/**
+ * calloc wrapper matching allocator_alloc. Large blocks come zeroed from
+ * the kernel, so their pages are not touched.
+ */
+static void *std_alloc_zeroed (size_t size, void *ctx)
+{
+  (void) ctx;
+  return calloc (1, size);
+}
+
+const allocator std_allocator = {std_alloc, std_realloc, std_free, NULL,
+                                 std_alloc_zeroed};
+
+/**
+ * Rounds a block size up to whole huge pages.
+ */
+static size_t huge_page_round (size_t size)
+{
+  return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+/**
+ * Maps large blocks on huge pages. Tries the reserved huge page pool first
+ * and falls back to transparent huge pages when it is empty.
+ * @return pointer to the block, NULL if the allocation failed.
+ */
+static void *huge_page_alloc (size_t size, void *ctx)
+{
+  (void) ctx;
+  if (size < HUGE_PAGE_SIZE)
+    return malloc (size);
+  size_t len = huge_page_round (size);
+  void *ptr = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr != MAP_FAILED)
+    return ptr;
+  ptr = mmap (NULL, len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  madvise (ptr, len, MADV_HUGEPAGE);
+  return ptr;
+}
+
+/**
+ * Allocates a zeroed block like huge_page_alloc: fresh mappings are zeroed
+ * by the kernel, and small blocks come from calloc.
+ * @return pointer to the block, NULL if the allocation failed.
+ */
+static void *huge_page_alloc_zeroed (size_t size, void *ctx)
+{
+  if (size < HUGE_PAGE_SIZE)
+    return calloc (1, size);
+  return huge_page_alloc (size, ctx);
+}
+
+/**
+ * Unmaps a block returned by huge_page_alloc.
+ */
+static void huge_page_free (void *ptr, size_t size, void *ctx)
+{
+  (void) ctx;
+  if (ptr == NULL)
+    return;
+  if (size < HUGE_PAGE_SIZE)
+    free (ptr);
+  else
+    munmap (ptr, huge_page_round (size));
+}
+
+/**
+ * Resizes a block returned by huge_page_alloc. Blocks which stay small are
+ * passed to realloc, others are copied to a new block.
+ * @return pointer to the block, NULL if the allocation failed (the old
+ * block is left untouched).
+ */
+static void *huge_page_realloc (void *ptr, size_t old_size, size_t new_size,
+                                void *ctx)
+{
+  if (old_size < HUGE_PAGE_SIZE && new_size < HUGE_PAGE_SIZE)
+    return realloc (ptr, new_size);
+  if (old_size >= HUGE_PAGE_SIZE && new_size >= HUGE_PAGE_SIZE
+      && huge_page_round (old_size) == huge_page_round (new_size))
+    return ptr;
+  void *new_ptr = huge_page_alloc (new_size, ctx);
+  if (new_ptr == NULL)
+    return NULL;
+  memcpy (new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  huge_page_free (ptr, old_size, ctx);
+  return new_ptr;
+}
+
+const allocator huge_page_allocator = {huge_page_alloc, huge_page_realloc,
+                                       huge_page_free, NULL,
+                                       huge_page_alloc_zeroed};
+
+/**
+ * Allocates a block of zeros. Uses the allocator's alloc_zeroed if it has
+ * one, and clears a block of its alloc otherwise.
+ * @param alloc an allocator.
+ * @param size size of the block in bytes.
+ * @return pointer to the block, NULL if the allocation failed.
+ */
+void *allocator_alloc_zeroed (const allocator *alloc, size_t size)
+{
+  if (alloc->alloc_zeroed != NULL)
+    return alloc->alloc_zeroed (size, alloc->ctx);
+  void *ptr = alloc->alloc (size, alloc->ctx);
+  if (ptr != NULL)
+    memset (ptr, 0, size);
+  return ptr;
+}
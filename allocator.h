@@ -0,0 +1,51 @@
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include <stdlib.h>
+
+/**
+ * Arrays of at least this many bytes are backed by huge pages when using
+ * huge_page_allocator.
+ */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+typedef void *(*allocator_alloc) (size_t size, void *ctx);
+typedef void *(*allocator_realloc) (void *ptr, size_t old_size,
+                                    size_t new_size, void *ctx);
+typedef void (*allocator_free) (void *ptr, size_t size, void *ctx);
+
+/**
+ * Memory source of the hash map and vector internals. Every call receives
+ * the size of the block, so implementations do not have to track it.
+ * alloc_zeroed is optional (NULL to leave it out): it returns a block of
+ * zeros, ideally without touching its pages, like calloc does for large
+ * blocks. Its blocks are freed with free.
+ */
+typedef struct allocator
+{
+  allocator_alloc alloc;
+  allocator_realloc realloc;
+  allocator_free free;
+  void *ctx;
+  allocator_alloc alloc_zeroed;
+} allocator;
+
+/**
+ * malloc, realloc and free. Used whenever no allocator is given.
+ */
+extern const allocator std_allocator;
+
+/**
+ * Maps blocks of at least HUGE_PAGE_SIZE bytes on huge pages, either
+ * explicit (MAP_HUGETLB) or transparent (MADV_HUGEPAGE), and passes smaller
+ * blocks to malloc.
+ */
+extern const allocator huge_page_allocator;
+
+/**
+ * Allocates a block of zeros from the allocator, with its alloc_zeroed if
+ * it has one.
+ */
+void *allocator_alloc_zeroed (const allocator *alloc, size_t size);
+
+#endif // ALLOCATOR_H_
@@ -0,0 +1,632 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hashmap_ext.h"
+#include "diskmap.h"
+#include "cvector.h"
+#include "vector_ext.h"
+#include "hash_funcs.h"
+
+#define DEFAULT_BENCH_SIZE (1UL << 22)
+#define LOOKUPS (1UL << 22)
+
+/**
+ * Copies an int key or value.
+ */
+void *int_cpy (const void *elem)
+{
+  int *new_int = malloc (sizeof (int));
+  if (new_int != NULL)
+    *new_int = *(const int *) elem;
+  return new_int;
+}
+
+/**
+ * Compares two int keys or values.
+ */
+int int_cmp (const void *elem_1, const void *elem_2)
+{
+  return *(const int *) elem_1 == *(const int *) elem_2;
+}
+
+/**
+ * Frees an int key or value.
+ */
+void int_free (void **elem)
+{
+  if (elem && *elem)
+    {
+      free (*elem);
+      *elem = NULL;
+    }
+}
+
+/**
+ * @return monotonic time in seconds.
+ */
+double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * xorshift pseudo random numbers, so runs are reproducible.
+ */
+size_t next_rand (size_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/**
+ * Int hash whose bits are scattered, so buckets collide as with real keys.
+ */
+size_t hash_int_mixed (const void *elem)
+{
+  size_t hash = (size_t) *(const int *) elem * 0x9e3779b97f4a7c15UL;
+  return hash ^ (hash >> 29);
+}
+
+/**
+ * Fills a map with the int keys [0, n) mapped to themselves.
+ * @return 1 if all the keys were inserted, 0 otherwise.
+ */
+int fill_int_map (hashmap *hash_map, size_t n)
+{
+  for (int i = 0; (size_t) i < n; i++)
+    {
+      pair *p = pair_alloc (&i, &i, int_cpy, int_cpy, int_cmp, int_cmp,
+                            int_free, int_free);
+      int inserted = hashmap_insert (hash_map, p);
+      void *to_free = p;
+      pair_free (&to_free);
+      if (!inserted)
+        return 0;
+    }
+  return 1;
+}
+
+/**
+ * Looks up LOOKUPS random keys of [0, key_range).
+ * @return average nanoseconds per lookup.
+ */
+double time_lookups (const hashmap *hash_map, size_t key_range)
+{
+  size_t state = 88172645463325252UL;
+  size_t found = 0;
+  double start = now ();
+  for (size_t i = 0; i < LOOKUPS; i++)
+    {
+      int key = (int) (next_rand (&state) % key_range);
+      found += hashmap_at (hash_map, &key) != NULL;
+    }
+  double elapsed = now () - start;
+  if (found == (size_t) -1)
+    puts ("");
+  return elapsed * 1e9 / (double) LOOKUPS;
+}
+
+/**
+ * Maps large blocks on pages of the base size, so the bucket table of the
+ * benchmark cannot be backed by transparent huge pages.
+ */
+void *small_page_alloc (size_t size, void *ctx)
+{
+  (void) ctx;
+  if (size < HUGE_PAGE_SIZE)
+    return malloc (size);
+  void *ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  madvise (ptr, size, MADV_NOHUGEPAGE);
+  return ptr;
+}
+
+/**
+ * Unmaps a block of small_page_alloc.
+ */
+void small_page_free (void *ptr, size_t size, void *ctx)
+{
+  (void) ctx;
+  if (size < HUGE_PAGE_SIZE)
+    free (ptr);
+  else
+    munmap (ptr, size);
+}
+
+/**
+ * Resizes a block of small_page_alloc.
+ */
+void *small_page_realloc (void *ptr, size_t old_size, size_t new_size,
+                          void *ctx)
+{
+  if (old_size < HUGE_PAGE_SIZE && new_size < HUGE_PAGE_SIZE)
+    return realloc (ptr, new_size);
+  void *new_ptr = small_page_alloc (new_size, ctx);
+  if (new_ptr == NULL)
+    return NULL;
+  memcpy (new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  small_page_free (ptr, old_size, ctx);
+  return new_ptr;
+}
+
+/**
+ * Lookup latency of a large table whose bucket table is on 4K pages
+ * against one on 2M pages.
+ */
+void bench_huge_pages (size_t n)
+{
+  const allocator small_pages = {small_page_alloc, small_page_realloc,
+                                 small_page_free, NULL, NULL};
+  const allocator *allocators[] = {&small_pages, &huge_page_allocator};
+  const char *names[] = {"4K pages", "2M pages"};
+  for (int i = 0; i < 2; i++)
+    {
+      hashmap *hash_map = hashmap_alloc_ex (hash_int, allocators[i]);
+      if (hash_map == NULL || !fill_int_map (hash_map, n))
+        {
+          fprintf (stderr, "%s: allocation failed\n", names[i]);
+          hashmap_free (&hash_map);
+          continue;
+        }
+      printf ("%s: %zu entries, %zu buckets, %.1f ns/lookup\n", names[i],
+              hash_map->size, hash_map->capacity,
+              time_lookups (hash_map, n));
+      hashmap_free (&hash_map);
+    }
+}
+
+/**
+ * Lookup latency with and without the negative lookup filter, for several
+ * shares of lookups which find their key.
+ */
+void bench_filter (size_t n)
+{
+  const size_t hit_percents[] = {100, 50, 10, 1};
+  for (int with_filter = 0; with_filter < 2; with_filter++)
+    {
+      hashmap *hash_map = hashmap_alloc (hash_int);
+      if (hash_map == NULL || !fill_int_map (hash_map, n)
+          || !hashmap_set_filter (hash_map, with_filter ? 8 : 0))
+        {
+          fprintf (stderr, "allocation failed\n");
+          hashmap_free (&hash_map);
+          return;
+        }
+      printf ("%s filter: %zu entries, %zu filter bytes (%.2f per entry)\n",
+              with_filter ? "with" : "without", hash_map->size,
+              hashmap_filter_size (hash_map),
+              (double) hashmap_filter_size (hash_map) / (double) n);
+      for (size_t i = 0; i < sizeof (hit_percents) / sizeof (size_t); i++)
+        printf ("  %3zu%% hits: %.1f ns/lookup\n", hit_percents[i],
+                time_lookups (hash_map, n * 100 / hit_percents[i]));
+      hashmap_free (&hash_map);
+    }
+}
+
+/**
+ * Allocator which counts the bytes it has handed out and not got back.
+ */
+static void *counting_alloc (size_t size, void *ctx)
+{
+  *(size_t *) ctx += size;
+  return malloc (size);
+}
+
+/**
+ * Resizes a block of counting_alloc.
+ */
+static void *counting_realloc (void *ptr, size_t old_size,
+                               size_t new_size, void *ctx)
+{
+  void *new_ptr = realloc (ptr, new_size);
+  if (new_ptr != NULL)
+    *(size_t *) ctx += new_size - old_size;
+  return new_ptr;
+}
+
+/**
+ * Frees a block of counting_alloc.
+ */
+static void counting_free (void *ptr, size_t size, void *ctx)
+{
+  *(size_t *) ctx -= size;
+  free (ptr);
+}
+
+/**
+ * Memory of the bucket table and vectors per entry, and lookup latency,
+ * at a high and a low load factor.
+ */
+void bench_layout (size_t n)
+{
+  const size_t sizes[] = {n, n * 2 / 3};
+  for (int i = 0; i < 2; i++)
+    {
+      size_t in_use = 0;
+      allocator counting = {counting_alloc, counting_realloc, counting_free,
+                            &in_use, NULL};
+      hashmap *hash_map = hashmap_alloc_ex (hash_int_mixed, &counting);
+      if (hash_map == NULL || !fill_int_map (hash_map, sizes[i]))
+        {
+          fprintf (stderr, "allocation failed\n");
+          hashmap_free (&hash_map);
+          return;
+        }
+      printf ("%zu entries, load factor %.2f: %.1f bytes/entry, "
+              "%.1f ns/lookup\n", hash_map->size,
+              hashmap_get_load_factor (hash_map),
+              (double) in_use / (double) hash_map->size,
+              time_lookups (hash_map, sizes[i]));
+      hashmap_free (&hash_map);
+    }
+}
+
+/**
+ * Wall time of doubling the table of a full map against the number of
+ * rehashing threads.
+ */
+void bench_rehash (size_t n)
+{
+  const size_t threads[] = {1, 2, 4, 8};
+  hashmap *hash_map = hashmap_alloc (hash_int_mixed);
+  if (hash_map == NULL || !fill_int_map (hash_map, n))
+    {
+      fprintf (stderr, "allocation failed\n");
+      hashmap_free (&hash_map);
+      return;
+    }
+  size_t capacity = hash_map->capacity;
+  printf ("%zu entries, %zu -> %zu buckets\n", hash_map->size, capacity,
+          capacity * 2);
+  for (size_t i = 0; i < sizeof (threads) / sizeof (size_t); i++)
+    {
+      double start = now ();
+      int rehashed = hashmap_rehash (hash_map, capacity * 2, threads[i]);
+      double elapsed = now () - start;
+      if (!rehashed || !hashmap_rehash (hash_map, capacity, 8))
+        {
+          fprintf (stderr, "rehash failed\n");
+          break;
+        }
+      printf ("  %zu threads: %.1f ms\n", threads[i], elapsed * 1e3);
+    }
+  hashmap_free (&hash_map);
+}
+
+/**
+ * Counts the keys diskmap_at_batch found.
+ */
+void count_found (size_t ind, const void *value, size_t value_len, void *ctx)
+{
+  (void) ind;
+  (void) value_len;
+  *(size_t *) ctx += value != NULL;
+}
+
+/**
+ * Fills a batch of diskmap keys, formatted from the given numbers.
+ */
+void make_key_batch (char (*keys)[24], const char **key_ptrs,
+                     size_t *key_lens, size_t batch, size_t first,
+                     size_t *state, size_t n)
+{
+  for (size_t i = 0; i < batch; i++)
+    {
+      size_t key = (state == NULL) ? first + i : next_rand (state) % n;
+      snprintf (keys[i], sizeof (keys[i]), "%015zu", key);
+      key_ptrs[i] = keys[i];
+      key_lens[i] = 15;
+    }
+}
+
+/**
+ * Batched insert, random lookup and batched lookup throughput of a diskmap
+ * holding n pairs of 15 byte keys and 100 byte values, against its memory
+ * budget as a share of the data.
+ */
+void bench_diskmap (size_t n)
+{
+  const size_t budget_percents[] = {200, 50, 25, 10};
+  const size_t batch = 1UL << 16;
+  const size_t lookups = 1UL << 12;
+  char value[100] = {0};
+  char (*keys)[24] = malloc (batch * sizeof (*keys));
+  const char **key_ptrs = malloc (batch * sizeof (char *));
+  size_t *key_lens = malloc (batch * sizeof (size_t));
+  const void **values = malloc (batch * sizeof (void *));
+  size_t *value_lens = malloc (batch * sizeof (size_t));
+  char dir[] = "diskmap-bench-XXXXXX";
+  if (keys == NULL || key_ptrs == NULL || key_lens == NULL || values == NULL
+      || value_lens == NULL || mkdtemp (dir) == NULL)
+    {
+      fprintf (stderr, "setup failed\n");
+      n = 0;
+    }
+  for (size_t i = 0; n != 0 && i < batch; i++)
+    {
+      values[i] = value;
+      value_lens[i] = sizeof (value);
+    }
+  size_t data = n * (15 + sizeof (value) + 96);
+  for (size_t b = 0; n != 0 && b < sizeof (budget_percents) / sizeof (size_t);
+       b++)
+    {
+      diskmap *map = diskmap_alloc (dir, 256, data / 100
+                                              * budget_percents[b]);
+      double start = now ();
+      for (size_t first = 0; map != NULL && first < n; first += batch)
+        {
+          size_t count = (n - first < batch) ? n - first : batch;
+          make_key_batch (keys, key_ptrs, key_lens, count, first, NULL, n);
+          if (diskmap_insert_batch (map, key_ptrs, key_lens, values,
+                                    value_lens, count) != (long) count)
+            diskmap_free (&map);
+        }
+      double insert_time = now () - start;
+      if (map == NULL)
+        {
+          fprintf (stderr, "insert failed\n");
+          break;
+        }
+      size_t state = 88172645463325252UL, found = 0;
+      make_key_batch (keys, key_ptrs, key_lens, lookups, 0, &state, n);
+      start = now ();
+      const void *found_value = NULL;
+      for (size_t i = 0; i < lookups; i++)
+        found += diskmap_at (map, key_ptrs[i], key_lens[i], &found_value,
+                             NULL) == 1;
+      double at_time = now () - start;
+      make_key_batch (keys, key_ptrs, key_lens, batch, 0, &state, n);
+      start = now ();
+      diskmap_at_batch (map, key_ptrs, key_lens, batch, count_found, &found);
+      double batch_time = now () - start;
+      printf ("budget %3zu%%: batched insert %.0f/s, at %.0f/s, "
+              "batched at %.0f/s (%zu found)\n", budget_percents[b],
+              (double) n / insert_time, (double) lookups / at_time,
+              (double) batch / batch_time, found);
+      diskmap_free (&map);
+    }
+  rmdir (dir);
+  free (keys);
+  free (key_ptrs);
+  free (key_lens);
+  free (values);
+  free (value_lens);
+}
+
+/**
+ * Number of int copies made by counted_int_cpy since it was last reset.
+ */
+size_t int_copies = 0;
+
+/**
+ * Copies an int key or value, counting the copies.
+ */
+void *counted_int_cpy (const void *elem)
+{
+  int_copies++;
+  return int_cpy (elem);
+}
+
+/**
+ * Inserts the int keys [0, n) in one of three ways: a pair copied by
+ * hashmap_insert, a pair adopted by hashmap_insert_take, or hashmap_emplace.
+ * @return 1 if all the keys were inserted, 0 otherwise.
+ */
+int insert_ints (hashmap *hash_map, size_t n, int mode)
+{
+  for (int i = 0; (size_t) i < n; i++)
+    {
+      int inserted;
+      if (mode == 2)
+        inserted = hashmap_emplace (hash_map, &i, &i, counted_int_cpy,
+                                    counted_int_cpy, int_cmp, int_cmp,
+                                    int_free, int_free);
+      else
+        {
+          pair *p = pair_alloc (&i, &i, counted_int_cpy, counted_int_cpy,
+                                int_cmp, int_cmp, int_free, int_free);
+          inserted = (mode == 0) ? hashmap_insert (hash_map, p)
+                                 : hashmap_insert_take (hash_map, &p);
+          void *to_free = p;
+          pair_free (&to_free);
+        }
+      if (!inserted)
+        return 0;
+    }
+  return 1;
+}
+
+/**
+ * Key and value copies and wall time per insert of copying, adopting and
+ * emplacing pairs.
+ */
+void bench_insert (size_t n)
+{
+  const char *modes[] = {"insert", "insert_take", "emplace"};
+  for (int mode = 0; mode < 3; mode++)
+    {
+      hashmap *hash_map = hashmap_alloc (hash_int_mixed);
+      size_t capacity = 1;
+      while (HASH_MAP_MAX_LOAD_FACTOR * (double) capacity < (double) n)
+        capacity *= 2;
+      // Sized upfront, so only the inserts themselves are timed.
+      int filled = hash_map != NULL && hashmap_rehash (hash_map, capacity, 1);
+      int_copies = 0;
+      double start = now ();
+      filled = filled && insert_ints (hash_map, n, mode);
+      double elapsed = now () - start;
+      if (!filled)
+        {
+          fprintf (stderr, "allocation failed\n");
+          hashmap_free (&hash_map);
+          return;
+        }
+      printf ("%-12s %.1f copies/insert, %.1f ns/insert\n", modes[mode],
+              (double) int_copies / (double) n, elapsed * 1e9 / (double) n);
+      hashmap_free (&hash_map);
+    }
+}
+
+/**
+ * Leaves an element to its owner.
+ */
+void keep_elem (void **elem)
+{
+  *elem = NULL;
+}
+
+typedef struct append_job
+{
+  cvector *cvec;
+  vector *vec;
+  pthread_mutex_t *lock;
+  int *values;
+  size_t n;
+} append_job;
+
+/**
+ * Appends pointers to the values of the job to its cvector.
+ */
+void *append_cvector (void *arg)
+{
+  append_job *job = arg;
+  for (size_t i = 0; i < job->n; i++)
+    if (!cvector_push_back_take (job->cvec, &job->values[i]))
+      return arg;
+  return NULL;
+}
+
+/**
+ * Appends pointers to the values of the job to its vector, under its lock.
+ */
+void *append_vector (void *arg)
+{
+  append_job *job = arg;
+  for (size_t i = 0; i < job->n; i++)
+    {
+      pthread_mutex_lock (job->lock);
+      int pushed = vector_push_back_take (job->vec, &job->values[i]);
+      pthread_mutex_unlock (job->lock);
+      if (!pushed)
+        return arg;
+    }
+  return NULL;
+}
+
+/**
+ * Runs nthreads producers appending n elements in all.
+ * @return wall time in seconds, -1 if an append failed.
+ */
+double time_appends (append_job *jobs, size_t nthreads, void *(*run) (void *))
+{
+  pthread_t threads[8];
+  int failed = 0;
+  size_t started = 0;
+  double start = now ();
+  for (; started < nthreads; started++)
+    if (pthread_create (&threads[started], NULL, run, &jobs[started]) != 0)
+      {
+        failed = 1;
+        break;
+      }
+  for (size_t t = 0; t < started; t++)
+    {
+      void *result;
+      pthread_join (threads[t], &result);
+      failed |= result != NULL;
+    }
+  double elapsed = now () - start;
+  return failed ? -1 : elapsed;
+}
+
+/**
+ * Multi-producer append throughput of a cvector against a vector behind a
+ * mutex.
+ */
+void bench_append (size_t n)
+{
+  const size_t threads[] = {1, 2, 4, 8};
+  int *values = malloc (sizeof (int) * n);
+  if (values == NULL)
+    {
+      fprintf (stderr, "allocation failed\n");
+      return;
+    }
+  for (size_t i = 0; i < n; i++)
+    values[i] = (int) i;
+  for (size_t i = 0; i < sizeof (threads) / sizeof (size_t); i++)
+    {
+      pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+      cvector *cvec = cvector_alloc (int_cpy, keep_elem, NULL);
+      vector *vec = vector_alloc (int_cpy, int_cmp, keep_elem);
+      append_job jobs[8];
+      for (size_t t = 0; t < threads[i]; t++)
+        {
+          jobs[t].cvec = cvec;
+          jobs[t].vec = vec;
+          jobs[t].lock = &lock;
+          jobs[t].values = values + t * (n / threads[i]);
+          jobs[t].n = n / threads[i];
+        }
+      double locked = -1, lock_free = -1;
+      if (cvec != NULL && vec != NULL)
+        {
+          locked = time_appends (jobs, threads[i], append_vector);
+          lock_free = time_appends (jobs, threads[i], append_cvector);
+        }
+      if (locked < 0 || lock_free < 0)
+        fprintf (stderr, "append failed\n");
+      else
+        printf ("%zu threads: mutex vector %.1f M/s, cvector %.1f M/s\n",
+                threads[i], (double) n / locked * 1e-6,
+                (double) n / lock_free * 1e-6);
+      cvector_free (&cvec);
+      vector_free (&vec);
+    }
+  free (values);
+}
+
+/**
+ * Runs the benchmark named by the first argument on a map of the size
+ * given by the second one.
+ */
+int main (int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "Usage: %s <benchmark> [size]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  size_t n = (argc < 3) ? DEFAULT_BENCH_SIZE : strtoul (argv[2], NULL, 10);
+  if (strcmp (argv[1], "huge_pages") == 0)
+    bench_huge_pages (n);
+  else if (strcmp (argv[1], "filter") == 0)
+    bench_filter (n);
+  else if (strcmp (argv[1], "layout") == 0)
+    bench_layout (n);
+  else if (strcmp (argv[1], "rehash") == 0)
+    bench_rehash (n);
+  else if (strcmp (argv[1], "diskmap") == 0)
+    bench_diskmap (n);
+  else if (strcmp (argv[1], "insert") == 0)
+    bench_insert (n);
+  else if (strcmp (argv[1], "append") == 0)
+    bench_append (n);
+  else
+    {
+      fprintf (stderr, "Unknown benchmark %s\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,220 @@
+#include <string.h>
+#include "cvector.h"
+
+#define CVECTOR_FIRST_SEGMENT_LOG 4
+#define CVECTOR_FIRST_SEGMENT ((size_t) 1 << CVECTOR_FIRST_SEGMENT_LOG)
+#define CVECTOR_SEGMENTS (sizeof (size_t) * 8 - CVECTOR_FIRST_SEGMENT_LOG)
+
+/**
+ * Segment k holds CVECTOR_FIRST_SEGMENT << k elements, following those of
+ * the segments before it. A segment is allocated by the first push which
+ * lands in it (or ahead of it) and stays in place until the vector is
+ * freed. Unwritten slots are NULL.
+ */
+struct cvector
+{
+  size_t reserved;
+  size_t size;
+  const allocator *alloc;
+  vector_elem_cpy elem_copy_func;
+  vector_elem_free elem_free_func;
+  void **segments[CVECTOR_SEGMENTS];
+};
+
+/**
+ * @return the number of elements of the segment.
+ */
+static size_t segment_size (size_t seg)
+{
+  return CVECTOR_FIRST_SEGMENT << seg;
+}
+
+/**
+ * Finds the slot of an index.
+ * @param ind index of an element.
+ * @param seg set to the segment of the index.
+ * @param off set to the offset of the index in its segment.
+ * @return 1 if the index fits in the vector, 0 otherwise.
+ */
+static int locate (size_t ind, size_t *seg, size_t *off)
+{
+  size_t shifted = ind + CVECTOR_FIRST_SEGMENT;
+  if (shifted < ind)
+    return 0;
+  int high = (int) (sizeof (unsigned long long) * 8) - 1
+             - __builtin_clzll ((unsigned long long) shifted);
+  *seg = (size_t) high - CVECTOR_FIRST_SEGMENT_LOG;
+  *off = shifted - ((size_t) 1 << high);
+  return 1;
+}
+
+/**
+ * Returns a segment, allocating it if no thread did yet. A thread which
+ * finds the segment missing allocates a zeroed copy and publishes it with
+ * a compare and swap; if another thread published one first, the copy is
+ * freed and the published one is returned. No thread waits for another.
+ * With an allocator which has alloc_zeroed, a losing copy is freed before
+ * any of its pages are touched, so it costs address space, not memory.
+ * @param vector a pointer to vector.
+ * @param seg index of the segment.
+ * @return the segment, NULL if it could not be allocated.
+ */
+static void **get_segment (cvector *vector, size_t seg)
+{
+  void **segment = __atomic_load_n (&vector->segments[seg], __ATOMIC_ACQUIRE);
+  if (segment != NULL)
+    return segment;
+  const allocator *alloc = vector->alloc;
+  size_t bytes = sizeof (void *) * segment_size (seg);
+  void **fresh = (void **) allocator_alloc_zeroed (alloc, bytes);
+  if (fresh == NULL)
+    return NULL;
+  if (__atomic_compare_exchange_n (&vector->segments[seg], &segment, fresh, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return fresh;
+  alloc->free (fresh, bytes, alloc->ctx);
+  return segment;
+}
+
+/**
+ * Dynamically allocates an empty vector. No segment is allocated until the
+ * first push.
+ * @param elem_copy_func func which copies the element stored in
+ * the vector (returns dynamically allocated copy).
+ * @param elem_free_func func which frees elements stored in the vector.
+ * @param alloc the allocator of the vector and its segments, must outlive
+ * the vector. NULL for std_allocator.
+ * @return pointer to dynamically allocated vector.
+ * @if_fail return NULL.
+ */
+cvector *cvector_alloc (vector_elem_cpy elem_copy_func,
+                        vector_elem_free elem_free_func,
+                        const allocator *alloc)
+{
+  if (elem_copy_func == NULL || elem_free_func == NULL)
+    return NULL;
+  if (alloc == NULL)
+    alloc = &std_allocator;
+  cvector *vector = (cvector *) alloc->alloc (sizeof (cvector), alloc->ctx);
+  if (vector == NULL)
+    return NULL;
+  memset (vector, 0, sizeof (cvector));
+  vector->alloc = alloc;
+  vector->elem_copy_func = elem_copy_func;
+  vector->elem_free_func = elem_free_func;
+  return vector;
+}
+
+/**
+ * Frees a vector with its elements. The threads which used the vector
+ * must be done with it.
+ * @param p_vector pointer to dynamically allocated pointer to vector.
+ */
+void cvector_free (cvector **p_vector)
+{
+  if (p_vector == NULL || *p_vector == NULL)
+    return;
+  cvector *vector = *p_vector;
+  const allocator *alloc = vector->alloc;
+  for (size_t seg = 0; seg < CVECTOR_SEGMENTS; seg++)
+    {
+      void **segment = vector->segments[seg];
+      if (segment == NULL)
+        continue;
+      for (size_t off = 0; off < segment_size (seg); off++)
+        if (segment[off] != NULL)
+          vector->elem_free_func (&segment[off]);
+      alloc->free (segment, sizeof (void *) * segment_size (seg), alloc->ctx);
+    }
+  alloc->free (vector, sizeof (cvector), alloc->ctx);
+  *p_vector = NULL;
+}
+
+/**
+ * Adds a copy of the value to the back of the vector. May be called by
+ * several threads at once.
+ * @param vector a pointer to vector.
+ * @param value the value to be added to the vector.
+ * @return 1 if the adding has been done successfully, 0 otherwise.
+ */
+int cvector_push_back (cvector *vector, const void *value)
+{
+  if (vector == NULL || value == NULL)
+    return 0;
+  void *copy = vector->elem_copy_func (value);
+  if (copy == NULL)
+    return 0;
+  if (!cvector_push_back_take (vector, copy))
+    {
+      vector->elem_free_func (&copy);
+      return 0;
+    }
+  return 1;
+}
+
+/**
+ * Adds an element to the back of the vector without copying it. The
+ * vector takes ownership of the element. May be called by several threads
+ * at once: each push reserves its own index with an atomic increment and
+ * then writes its slot, and a missing segment is published with a compare
+ * and swap, so pushes never wait for each other.
+ * Pushes finish in any order, so an element may be visible while a lower
+ * index is still NULL.
+ * @param vector a pointer to vector.
+ * @param elem the element to be added to the vector.
+ * @return 1 if the adding has been done successfully, 0 otherwise (the
+ * element then still belongs to the caller, and its index stays NULL).
+ */
+int cvector_push_back_take (cvector *vector, void *elem)
+{
+  if (vector == NULL || elem == NULL)
+    return 0;
+  size_t ind = __atomic_fetch_add (&vector->reserved, 1, __ATOMIC_RELAXED);
+  size_t seg, off;
+  if (!locate (ind, &seg, &off))
+    return 0;
+  void **segment = get_segment (vector, seg);
+  if (segment == NULL)
+    return 0;
+  // One push per segment allocates the next one ahead of the pushes which
+  // need it, so they rarely race to allocate it.
+  if (off == segment_size (seg) / 2 && seg + 1 < CVECTOR_SEGMENTS)
+    get_segment (vector, seg + 1);
+  __atomic_store_n (&segment[off], elem, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&vector->size, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * Returns the element at the given index. May be called while other
+ * threads push to the vector.
+ * @param vector a pointer to vector.
+ * @param ind the index of the element we want to get.
+ * @return the element at the given index if it was pushed
+ * (the element itself, not a copy of it),
+ * NULL otherwise.
+ */
+void *cvector_at (const cvector *vector, size_t ind)
+{
+  size_t seg, off;
+  if (vector == NULL || !locate (ind, &seg, &off))
+    return NULL;
+  void **segment = __atomic_load_n (&vector->segments[seg], __ATOMIC_ACQUIRE);
+  if (segment == NULL)
+    return NULL;
+  return __atomic_load_n (&segment[off], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * This function returns the number of completed pushes to the vector.
+ * Once the pushing threads are done, and if none of their pushes failed,
+ * these are the indices [0, size).
+ * @param vector a pointer to vector.
+ * @return the number of elements, 0 if vector is NULL.
+ */
+size_t cvector_size (const cvector *vector)
+{
+  if (vector == NULL)
+    return 0;
+  return __atomic_load_n (&vector->size, __ATOMIC_ACQUIRE);
+}
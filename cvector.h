@@ -0,0 +1,49 @@
+#ifndef CVECTOR_H_
+#define CVECTOR_H_
+
+#include "vector.h"
+#include "allocator.h"
+
+/**
+ * Append-only vector which any number of threads may push to and read
+ * from at once. Elements live in segments of exponentially growing size
+ * which never move, so growing never invalidates an element or a reader.
+ */
+typedef struct cvector cvector;
+
+/**
+ * Dynamically allocates an empty vector (alloc NULL for std_allocator).
+ */
+cvector *cvector_alloc (vector_elem_cpy elem_copy_func,
+                        vector_elem_free elem_free_func,
+                        const allocator *alloc);
+
+/**
+ * Frees the vector with its elements. No other thread may use it.
+ */
+void cvector_free (cvector **p_vector);
+
+/**
+ * Adds a copy of the value to the back of the vector. Thread safe, and
+ * pushes never wait for each other.
+ */
+int cvector_push_back (cvector *vector, const void *value);
+
+/**
+ * Adds an element to the back of the vector without copying it.
+ * Thread safe, and pushes never wait for each other.
+ */
+int cvector_push_back_take (cvector *vector, void *elem);
+
+/**
+ * Returns the element at the given index, NULL if it was not pushed yet.
+ * Thread safe.
+ */
+void *cvector_at (const cvector *vector, size_t ind);
+
+/**
+ * This function returns the number of completed pushes to the vector.
+ */
+size_t cvector_size (const cvector *vector);
+
+#endif // CVECTOR_H_
@@ -0,0 +1,715 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "diskmap.h"
+#include "hashmap_ext.h"
+#include "str_key.h"
+
+/**
+ * Estimated memory of a resident pair besides its key and value bytes:
+ * the pair, the key and value headers and a share of the bucket table.
+ */
+#define DISKMAP_ENTRY_OVERHEAD 96
+#define DISKMAP_IO_BUFFER (1UL << 20)
+
+/**
+ * A value, stored with its length.
+ */
+typedef struct blob
+{
+  size_t len;
+  char bytes[];
+} blob;
+
+/**
+ * A partition of the keys. Its pairs are in map while it is resident, and
+ * in its file once it has been written out.
+ */
+typedef struct partition
+{
+  hashmap *map;
+  size_t bytes;
+  size_t last_use;
+  int dirty;
+  int on_disk;
+} partition;
+
+struct diskmap
+{
+  char *dir;
+  size_t npartitions;
+  size_t budget;
+  size_t resident;
+  size_t clock;
+  size_t size;
+  partition *partitions;
+};
+
+/**
+ * Copies a blob value.
+ */
+static void *blob_cpy (const void *value)
+{
+  const blob *orig = value;
+  blob *copy = malloc (sizeof (blob) + orig->len);
+  if (copy == NULL)
+    return NULL;
+  copy->len = orig->len;
+  memcpy (copy->bytes, orig->bytes, orig->len);
+  return copy;
+}
+
+/**
+ * Compares two blob values.
+ */
+static int blob_cmp (const void *value_1, const void *value_2)
+{
+  const blob *blob_1 = value_1, *blob_2 = value_2;
+  return blob_1->len == blob_2->len
+         && memcmp (blob_1->bytes, blob_2->bytes, blob_1->len) == 0;
+}
+
+/**
+ * Frees a blob value.
+ */
+static void blob_free (void **value)
+{
+  if (value && *value)
+    {
+      free (*value);
+      *value = NULL;
+    }
+}
+
+/**
+ * @return estimated memory of a resident pair.
+ */
+static size_t entry_bytes (size_t key_len, size_t value_len)
+{
+  return key_len + value_len + DISKMAP_ENTRY_OVERHEAD;
+}
+
+/**
+ * @return a dynamically allocated blob of len bytes, NULL if the
+ * allocation failed or len is too large.
+ */
+static blob *blob_alloc (size_t len)
+{
+  if (SIZE_MAX - sizeof (blob) < len)
+    return NULL;
+  blob *value = malloc (sizeof (blob) + len);
+  if (value != NULL)
+    value->len = len;
+  return value;
+}
+
+/**
+ * Inserts a key and a blob to a partition's hash map, which takes
+ * ownership of the blob.
+ * @return 1 for successful insertion, 0 otherwise (the blob is then
+ * freed).
+ */
+static int insert_blob (hashmap *hash_map, const char *key, size_t key_len,
+                        blob *value)
+{
+  if (hashmap_insert_str_take (hash_map, key, key_len, value, blob_cpy,
+                               blob_cmp, blob_free))
+    return 1;
+  free (value);
+  return 0;
+}
+
+/**
+ * Inserts a key and a copy of the value to a partition's hash map.
+ * @return 1 for successful insertion, 0 otherwise.
+ */
+static int insert_value (hashmap *hash_map, const char *key, size_t key_len,
+                         const void *value, size_t value_len)
+{
+  blob *in_value = blob_alloc (value_len);
+  if (in_value == NULL)
+    return 0;
+  memcpy (in_value->bytes, value, value_len);
+  return insert_blob (hash_map, key, key_len, in_value);
+}
+
+/**
+ * @return the path of the file of partition p, with the given suffix.
+ * Dynamically allocated, NULL if the allocation failed.
+ */
+static char *partition_path (const diskmap *map, size_t p,
+                             const char *suffix)
+{
+  size_t len = strlen (map->dir) + strlen (suffix) + 32;
+  char *path = malloc (len);
+  if (path != NULL)
+    snprintf (path, len, "%s/part-%zu%s", map->dir, p, suffix);
+  return path;
+}
+
+/**
+ * @return the partition of the key.
+ */
+static size_t partition_of (const diskmap *map, const char *key,
+                            size_t key_len)
+{
+  // The low bits of the hash pick the bucket inside the partition.
+  return (str_hash (key, key_len) >> 32) % map->npartitions;
+}
+
+/**
+ * Writes a pair to a partition file as its key length, value length, key
+ * bytes and value bytes.
+ * @return 1 if the pair was written, 0 otherwise.
+ */
+static int write_record (const pair *elem, void *ctx)
+{
+  const str_key *key = elem->key;
+  const blob *value = elem->value;
+  FILE *file = ctx;
+  return fwrite (&key->len, sizeof (size_t), 1, file) == 1
+         && fwrite (&value->len, sizeof (size_t), 1, file) == 1
+         && fwrite (key->bytes, 1, key->len, file) == key->len
+         && fwrite (value->bytes, 1, value->len, file) == value->len;
+}
+
+/**
+ * Writes a resident partition to its file, sequentially. The file is
+ * replaced only once it has been fully written.
+ * @return 1 if the partition was written, 0 otherwise.
+ */
+static int partition_write (diskmap *map, size_t p)
+{
+  char *tmp_path = partition_path (map, p, ".tmp");
+  char *path = partition_path (map, p, "");
+  FILE *file = (tmp_path == NULL) ? NULL : fopen (tmp_path, "wb");
+  int ok = path != NULL && file != NULL;
+  if (ok)
+    {
+      setvbuf (file, NULL, _IOFBF, DISKMAP_IO_BUFFER);
+      ok = hashmap_for_each (map->partitions[p].map, write_record, file) >= 0;
+    }
+  if (file != NULL)
+    ok = (fclose (file) == 0) && ok;
+  ok = ok && rename (tmp_path, path) == 0;
+  if (!ok && file != NULL)
+    remove (tmp_path);
+  free (tmp_path);
+  free (path);
+  if (ok)
+    map->partitions[p].on_disk = 1;
+  return ok;
+}
+
+/**
+ * Reads exactly size bytes from a file.
+ * @return 1 if they were read, 0 otherwise.
+ */
+static int read_exact (FILE *file, void *buffer, size_t size)
+{
+  return fread (buffer, 1, size, file) == size;
+}
+
+/**
+ * Finds the size of a file, and goes back to its start.
+ * @return 1 if the size was found, 0 otherwise.
+ */
+static int file_size (FILE *file, size_t *size)
+{
+  if (fseek (file, 0, SEEK_END) != 0)
+    return 0;
+  long end = ftell (file);
+  if (end < 0 || fseek (file, 0, SEEK_SET) != 0)
+    return 0;
+  *size = (size_t) end;
+  return 1;
+}
+
+/**
+ * Reads the pairs of a partition file into the hash map. The value bytes
+ * are read straight into the blob which the hash map keeps. The lengths
+ * of a record are checked against the bytes left in the file before
+ * anything is allocated for it, so a corrupted file fails to load.
+ * @param file the partition file, at its start.
+ * @param left size of the file.
+ * @return 1 if the whole file was read, 0 otherwise.
+ */
+static int read_records (FILE *file, size_t left, hashmap *hash_map,
+                         size_t *bytes)
+{
+  char *buffer = NULL;
+  size_t buffer_size = 0;
+  size_t lens[2];
+  size_t read = 0;
+  int ok = 1;
+  while (ok && (read = fread (lens, sizeof (size_t), 2, file)) == 2)
+    {
+      left = (left < sizeof (lens)) ? 0 : left - sizeof (lens);
+      if (left < lens[0] || left - lens[0] < lens[1])
+        {
+          ok = 0;
+          break;
+        }
+      left -= lens[0] + lens[1];
+      if (buffer_size < lens[0])
+        {
+          char *new_buffer = realloc (buffer, lens[0]);
+          if (new_buffer == NULL)
+            {
+              ok = 0;
+              break;
+            }
+          buffer = new_buffer;
+          buffer_size = lens[0];
+        }
+      blob *value = NULL;
+      ok = read_exact (file, buffer, lens[0])
+           && (value = blob_alloc (lens[1])) != NULL;
+      if (ok && !read_exact (file, value->bytes, lens[1]))
+        {
+          free (value);
+          ok = 0;
+        }
+      ok = ok && insert_blob (hash_map, buffer, lens[0], value);
+      *bytes += entry_bytes (lens[0], lens[1]);
+    }
+  free (buffer);
+  return ok && read == 0 && !ferror (file);
+}
+
+/**
+ * Makes a partition resident, reading it from its file if it has one.
+ * @return 1 if the partition is resident, 0 otherwise.
+ */
+static int partition_load (diskmap *map, size_t p)
+{
+  partition *part = &map->partitions[p];
+  hashmap *hash_map = hashmap_alloc_str (NULL);
+  if (hash_map == NULL)
+    return 0;
+  size_t bytes = 0;
+  if (part->on_disk)
+    {
+      char *path = partition_path (map, p, "");
+      FILE *file = (path == NULL) ? NULL : fopen (path, "rb");
+      int ok = file != NULL;
+      if (ok)
+        {
+          setvbuf (file, NULL, _IOFBF, DISKMAP_IO_BUFFER);
+          size_t size = 0;
+          ok = file_size (file, &size)
+               && read_records (file, size, hash_map, &bytes);
+          fclose (file);
+        }
+      free (path);
+      if (!ok)
+        {
+          hashmap_free (&hash_map);
+          return 0;
+        }
+    }
+  part->map = hash_map;
+  part->bytes = bytes;
+  part->dirty = 0;
+  map->resident += bytes;
+  return 1;
+}
+
+/**
+ * Writes out a resident partition if it changed, and frees its memory.
+ * @return 1 if the partition was evicted, 0 otherwise (it then stays
+ * resident).
+ */
+static int partition_evict (diskmap *map, size_t p)
+{
+  partition *part = &map->partitions[p];
+  if (part->dirty && !partition_write (map, p))
+    return 0;
+  hashmap_free (&part->map);
+  map->resident -= part->bytes;
+  part->bytes = 0;
+  part->dirty = 0;
+  return 1;
+}
+
+/**
+ * Evicts the least recently used partitions, other than the one in use,
+ * until the resident ones fit in the memory budget. A single partition
+ * larger than the budget stays resident.
+ * @param map a map.
+ * @param in_use the partition in use.
+ */
+static void diskmap_balance (diskmap *map, size_t in_use)
+{
+  while (map->budget < map->resident)
+    {
+      size_t victim = map->npartitions;
+      for (size_t p = 0; p < map->npartitions; p++)
+        if (p != in_use && map->partitions[p].map != NULL
+            && (victim == map->npartitions
+                || map->partitions[p].last_use
+                   < map->partitions[victim].last_use))
+          victim = p;
+      if (victim == map->npartitions || !partition_evict (map, victim))
+        return;
+    }
+}
+
+/**
+ * Makes a partition resident and marks it as the most recently used.
+ * @return 1 if the partition is resident, 0 otherwise.
+ */
+static int partition_use (diskmap *map, size_t p)
+{
+  if (map->partitions[p].map == NULL && !partition_load (map, p))
+    return 0;
+  map->partitions[p].last_use = ++map->clock;
+  diskmap_balance (map, p);
+  return 1;
+}
+
+/**
+ * Dynamically allocates an empty map.
+ * @param dir an existing directory on local disk, where the partition
+ * files are written.
+ * @param npartitions number of partitions of the keys. A partition is the
+ * unit of reading and writing, so it should be a small part of the budget.
+ * @param memory_budget estimated bytes the resident partitions may take.
+ * @return pointer to dynamically allocated map.
+ * @if_fail return NULL.
+ */
+diskmap *diskmap_alloc (const char *dir, size_t npartitions,
+                        size_t memory_budget)
+{
+  if (dir == NULL || npartitions == 0)
+    return NULL;
+  diskmap *map = malloc (sizeof (diskmap));
+  if (map == NULL)
+    return NULL;
+  map->dir = malloc (strlen (dir) + 1);
+  map->partitions = calloc (npartitions, sizeof (partition));
+  if (map->dir == NULL || map->partitions == NULL)
+    {
+      free (map->dir);
+      free (map->partitions);
+      free (map);
+      return NULL;
+    }
+  strcpy (map->dir, dir);
+  map->npartitions = npartitions;
+  map->budget = memory_budget;
+  map->resident = 0;
+  map->clock = 0;
+  map->size = 0;
+  return map;
+}
+
+/**
+ * Frees the map and removes its partition files.
+ * @param p_map pointer to dynamically allocated pointer to map.
+ */
+void diskmap_free (diskmap **p_map)
+{
+  if (p_map == NULL || *p_map == NULL)
+    return;
+  diskmap *map = *p_map;
+  for (size_t p = 0; p < map->npartitions; p++)
+    {
+      hashmap_free (&map->partitions[p].map);
+      char *path = map->partitions[p].on_disk ? partition_path (map, p, "")
+                                              : NULL;
+      if (path != NULL)
+        remove (path);
+      free (path);
+    }
+  free (map->partitions);
+  free (map->dir);
+  free (map);
+  *p_map = NULL;
+}
+
+/**
+ * Inserts a copy of the key and value to the map.
+ * @param map a map.
+ * @param key the bytes of the key.
+ * @param key_len number of bytes of the key.
+ * @param value the bytes of the value.
+ * @param value_len number of bytes of the value.
+ * @return 1 for successful insertion, 0 if the key is already in the map,
+ * -1 if the function failed (also if the partition of the key could not be
+ * read from or written to disk).
+ */
+int diskmap_insert (diskmap *map, const char *key, size_t key_len,
+                    const void *value, size_t value_len)
+{
+  if (map == NULL || (key == NULL && key_len != 0)
+      || (value == NULL && value_len != 0))
+    return -1;
+  size_t p = partition_of (map, key, key_len);
+  if (!partition_use (map, p))
+    return -1;
+  if (hashmap_at_str (map->partitions[p].map, key, key_len) != NULL)
+    return 0;
+  if (!insert_value (map->partitions[p].map, key, key_len, value, value_len))
+    return -1;
+  partition *part = &map->partitions[p];
+  part->bytes += entry_bytes (key_len, value_len);
+  part->dirty = 1;
+  map->resident += entry_bytes (key_len, value_len);
+  map->size++;
+  diskmap_balance (map, p);
+  return 1;
+}
+
+/**
+ * The function looks up the value associated with the given key, reading
+ * its partition from disk if it is not resident.
+ * @param map a map.
+ * @param key the bytes of the key.
+ * @param key_len number of bytes of the key.
+ * @param value set to the value if the key is in the map, NULL otherwise.
+ * The value stays valid until the next call on the map.
+ * @param value_len set to the length of the value, if not NULL.
+ * @return 1 if the key is in the map, 0 if it is not, -1 if the function
+ * failed (also if the partition of the key could not be read from disk,
+ * so the key may be in the map).
+ */
+int diskmap_at (diskmap *map, const char *key, size_t key_len,
+                const void **value, size_t *value_len)
+{
+  if (map == NULL || (key == NULL && key_len != 0) || value == NULL)
+    return -1;
+  *value = NULL;
+  size_t p = partition_of (map, key, key_len);
+  if (!partition_use (map, p))
+    return -1;
+  const blob *found = hashmap_at_str (map->partitions[p].map, key, key_len);
+  if (found == NULL)
+    return 0;
+  *value = found->bytes;
+  if (value_len != NULL)
+    *value_len = found->len;
+  return 1;
+}
+
+/**
+ * The function erases the pair associated with key.
+ * @param map a map.
+ * @param key the bytes of the key.
+ * @param key_len number of bytes of the key.
+ * @return 1 if the pair was erased, 0 if the key is not in the map, -1 if
+ * the function failed (also if the partition of the key could not be read
+ * from disk, so the key may be in the map).
+ */
+int diskmap_erase (diskmap *map, const char *key, size_t key_len)
+{
+  if (map == NULL || (key == NULL && key_len != 0))
+    return -1;
+  size_t p = partition_of (map, key, key_len);
+  if (!partition_use (map, p))
+    return -1;
+  partition *part = &map->partitions[p];
+  const blob *value = hashmap_at_str (part->map, key, key_len);
+  if (value == NULL)
+    return 0;
+  size_t bytes = entry_bytes (key_len, value->len);
+  if (!hashmap_erase_str (part->map, key, key_len))
+    return -1;
+  part->bytes -= bytes;
+  part->dirty = 1;
+  map->resident -= bytes;
+  map->size--;
+  return 1;
+}
+
+/**
+ * Keys of a batch grouped by partition: the indices of the keys of
+ * partition p are order[starts[p]] to order[starts[p + 1] - 1], and the
+ * partitions with keys are listed in schedule, resident ones first, so
+ * they are served before they can be evicted.
+ */
+typedef struct batch_plan
+{
+  size_t *order;
+  size_t *starts;
+  size_t *schedule;
+  size_t scheduled;
+} batch_plan;
+
+/**
+ * Frees the arrays of a plan.
+ */
+static void plan_free (batch_plan *plan)
+{
+  free (plan->order);
+  free (plan->starts);
+  free (plan->schedule);
+}
+
+/**
+ * Groups the keys of a batch by partition, with a counting sort.
+ * @return 1 if the plan was made, 0 otherwise.
+ */
+static int plan_batch (const diskmap *map, const char *const *keys,
+                       const size_t *key_lens, size_t n, batch_plan *plan)
+{
+  size_t *parts = malloc (n * sizeof (size_t));
+  plan->order = malloc (n * sizeof (size_t));
+  plan->starts = calloc (map->npartitions + 1, sizeof (size_t));
+  plan->schedule = malloc (map->npartitions * sizeof (size_t));
+  plan->scheduled = 0;
+  if (parts == NULL || plan->order == NULL || plan->starts == NULL
+      || plan->schedule == NULL)
+    {
+      free (parts);
+      plan_free (plan);
+      return 0;
+    }
+  size_t *starts = plan->starts;
+  for (size_t i = 0; i < n; i++)
+    {
+      parts[i] = partition_of (map, keys[i], key_lens[i]);
+      starts[parts[i] + 1]++;
+    }
+  for (size_t p = 0; p < map->npartitions; p++)
+    starts[p + 1] += starts[p];
+  for (size_t i = 0; i < n; i++)
+    plan->order[starts[parts[i]]++] = i;
+  for (size_t p = map->npartitions; 0 < p; p--)
+    starts[p] = starts[p - 1];
+  starts[0] = 0;
+  free (parts);
+
+  for (int resident = 1; 0 <= resident; resident--)
+    for (size_t p = 0; p < map->npartitions; p++)
+      if (starts[p] != starts[p + 1]
+          && (map->partitions[p].map != NULL) == resident)
+        plan->schedule[plan->scheduled++] = p;
+  return 1;
+}
+
+/**
+ * Looks up many keys. The keys are grouped by partition, resident
+ * partitions are served first, and every other partition is read from
+ * disk once, sequentially.
+ * @param map a map.
+ * @param keys the bytes of the keys.
+ * @param key_lens number of bytes of each key.
+ * @param n number of keys.
+ * @param visit called with the index of each key in the batch and its
+ * value (NULL if the key is missing), while the value is valid.
+ * @param ctx passed to visit.
+ * @return number of keys found, -1 if the function failed.
+ */
+long diskmap_at_batch (diskmap *map, const char *const *keys,
+                       const size_t *key_lens, size_t n, diskmap_visit visit,
+                       void *ctx)
+{
+  if (map == NULL || (n != 0 && (keys == NULL || key_lens == NULL))
+      || visit == NULL)
+    return -1;
+  batch_plan plan;
+  if (n == 0)
+    return 0;
+  if (!plan_batch (map, keys, key_lens, n, &plan))
+    return -1;
+  long found = 0;
+  for (size_t s = 0; s < plan.scheduled; s++)
+    {
+      size_t p = plan.schedule[s];
+      if (!partition_use (map, p))
+        {
+          found = -1;
+          break;
+        }
+      for (size_t i = plan.starts[p]; i < plan.starts[p + 1]; i++)
+        {
+          size_t ind = plan.order[i];
+          const blob *value = hashmap_at_str (map->partitions[p].map,
+                                              keys[ind], key_lens[ind]);
+          visit (ind, value ? value->bytes : NULL, value ? value->len : 0,
+                 ctx);
+          found += value != NULL;
+        }
+    }
+  plan_free (&plan);
+  return found;
+}
+
+/**
+ * Inserts copies of many keys and values. The pairs are grouped by
+ * partition like in diskmap_at_batch, so each partition is read and
+ * written at most once per batch.
+ * @param map a map.
+ * @param keys the bytes of the keys.
+ * @param key_lens number of bytes of each key.
+ * @param values the bytes of the values.
+ * @param value_lens number of bytes of each value.
+ * @param n number of pairs.
+ * @return number of pairs inserted (keys already in the map are skipped),
+ * -1 if the function failed (pairs of the batch may have been inserted
+ * already).
+ */
+long diskmap_insert_batch (diskmap *map, const char *const *keys,
+                           const size_t *key_lens, const void *const *values,
+                           const size_t *value_lens, size_t n)
+{
+  if (map == NULL || (n != 0 && (keys == NULL || key_lens == NULL
+                                 || values == NULL || value_lens == NULL)))
+    return -1;
+  batch_plan plan;
+  if (n == 0)
+    return 0;
+  if (!plan_batch (map, keys, key_lens, n, &plan))
+    return -1;
+  long inserted = 0;
+  for (size_t s = 0; 0 <= inserted && s < plan.scheduled; s++)
+    {
+      size_t p = plan.schedule[s];
+      if (!partition_use (map, p))
+        {
+          inserted = -1;
+          break;
+        }
+      partition *part = &map->partitions[p];
+      for (size_t i = plan.starts[p]; i < plan.starts[p + 1]; i++)
+        {
+          size_t ind = plan.order[i];
+          if (hashmap_at_str (part->map, keys[ind], key_lens[ind]) != NULL)
+            continue;
+          if (!insert_value (part->map, keys[ind], key_lens[ind],
+                             values[ind], value_lens[ind]))
+            {
+              inserted = -1;
+              break;
+            }
+          size_t bytes = entry_bytes (key_lens[ind], value_lens[ind]);
+          part->bytes += bytes;
+          part->dirty = 1;
+          map->resident += bytes;
+          map->size++;
+          inserted++;
+        }
+      diskmap_balance (map, p);
+    }
+  plan_free (&plan);
+  return inserted;
+}
+
+/**
+ * @param map a map.
+ * @return number of pairs in the map.
+ */
+size_t diskmap_size (const diskmap *map)
+{
+  return (map == NULL) ? 0 : map->size;
+}
+
+/**
+ * @param map a map.
+ * @return estimated bytes taken by the resident partitions.
+ */
+size_t diskmap_resident_size (const diskmap *map)
+{
+  return (map == NULL) ? 0 : map->resident;
+}
@@ -0,0 +1,79 @@
+#ifndef DISKMAP_H_
+#define DISKMAP_H_
+
+#include <stdlib.h>
+
+/**
+ * A map of byte string keys to byte string values which may be larger
+ * than memory. The keys are hash partitioned; partitions are hash maps
+ * while resident in memory and files of a directory on local disk
+ * otherwise. Within a memory budget, the least recently used partitions
+ * are written out and read back on access.
+ */
+typedef struct diskmap diskmap;
+
+/**
+ * Called by diskmap_at_batch for every key of the batch, with its index in
+ * the batch and its value (NULL if the key is missing).
+ */
+typedef void (*diskmap_visit) (size_t ind, const void *value,
+                               size_t value_len, void *ctx);
+
+/**
+ * Dynamically allocates an empty map whose partitions are spilled to dir.
+ */
+diskmap *diskmap_alloc (const char *dir, size_t npartitions,
+                        size_t memory_budget);
+
+/**
+ * Frees the map and removes its partition files.
+ */
+void diskmap_free (diskmap **p_map);
+
+/**
+ * Inserts a copy of the key and value to the map. Returns 1 if it was
+ * inserted, 0 if the key is already in the map, -1 on failure.
+ */
+int diskmap_insert (diskmap *map, const char *key, size_t key_len,
+                    const void *value, size_t value_len);
+
+/**
+ * Sets *value to the value of the key, valid until the next call on the
+ * map. Returns 1 if the key was found, 0 if it is missing, -1 on failure
+ * (e.g. its partition could not be read from disk).
+ */
+int diskmap_at (diskmap *map, const char *key, size_t key_len,
+                const void **value, size_t *value_len);
+
+/**
+ * Erases the key from the map. Returns 1 if it was erased, 0 if it is
+ * missing, -1 on failure.
+ */
+int diskmap_erase (diskmap *map, const char *key, size_t key_len);
+
+/**
+ * Looks up many keys, reading each partition they fall in once.
+ */
+long diskmap_at_batch (diskmap *map, const char *const *keys,
+                       const size_t *key_lens, size_t n, diskmap_visit visit,
+                       void *ctx);
+
+/**
+ * Inserts copies of many keys and values, reading and writing each
+ * partition at most once.
+ */
+long diskmap_insert_batch (diskmap *map, const char *const *keys,
+                           const size_t *key_lens, const void *const *values,
+                           const size_t *value_lens, size_t n);
+
+/**
+ * @return number of pairs in the map.
+ */
+size_t diskmap_size (const diskmap *map);
+
+/**
+ * @return estimated bytes taken by the resident partitions.
+ */
+size_t diskmap_resident_size (const diskmap *map);
+
+#endif // DISKMAP_H_
@@ -1,6 +1,370 @@
-#include "hashmap.h"
-#define MINIMIZE 0
-#define MAGNIFY 1
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hashmap_ext.h"
+#include "vector_ext.h"
+#include "str_key.h"
+#define REHASH_MIN_BUCKETS_PER_THREAD 4096
+#define CACHE_LINE 64
+#define FILTER_BLOCK_BITS 512
+#define FILTER_BLOCK_WORDS (FILTER_BLOCK_BITS / 64)
+#define FILTER_HASHES 6
+#define INLINE_TAG ((uintptr_t) 1)
+
+/**
+ * Every hash map is allocated inside a block which also remembers the
+ * allocator its bucket table and vectors come from, and holds the
+ * optional negative lookup filter and the arena of string keys.
+ * The filter is a Bloom filter split in cache line sized blocks; a key
+ * sets FILTER_HASHES bits of a single block.
+ */
+typedef struct hashmap_block
+{
+  hashmap map;
+  const allocator *alloc;
+  size_t filter_bits;
+  size_t filter_blocks;
+  uint64_t *filter;
+  void *filter_mem;
+  str_arena *str_keys;
+  size_t rehash_threads;
+} hashmap_block;
+
+#define HASHMAP_BLOCK(m) \
+  ((hashmap_block *) ((char *) (m) - offsetof (hashmap_block, map)))
+
+/**
+ * The hash map's own copy of a pair. Buckets hold entries, and a clone or
+ * a copy of a shared bucket adds an owner to an entry instead of copying
+ * its pair; the key and value are copied only when a map modifies a value
+ * which another map still holds. The pair comes first, so the pair of an
+ * entry is the entry.
+ */
+typedef struct entry
+{
+  pair elem;
+  size_t refs;
+} entry;
+
+/**
+ * A bucket is NULL, a vector of pairs, or - for the common bucket of a
+ * single pair - the pair itself tagged with INLINE_TAG, which saves the
+ * vector allocation and a dependent load. A bucket spills to a vector on
+ * its first collision.
+ * @param bucket a bucket.
+ * @return 1 if the bucket is a single inline pair, 0 otherwise.
+ */
+static int bucket_is_inline (const vector *bucket)
+{
+  return ((uintptr_t) bucket & INLINE_TAG) != 0;
+}
+
+/**
+ * @param bucket a bucket.
+ * @return the number of pairs in the bucket.
+ */
+static size_t bucket_size (const vector *bucket)
+{
+  if (bucket == NULL)
+    return 0;
+  return bucket_is_inline (bucket) ? 1 : bucket->size;
+}
+
+/**
+ * @param bucket a bucket.
+ * @param ind index of a pair in the bucket, less than bucket_size.
+ * @return the pair (the pair itself, not a copy of it).
+ */
+static pair *bucket_at (const vector *bucket, size_t ind)
+{
+  if (bucket_is_inline (bucket))
+    return (pair *) ((uintptr_t) bucket & ~INLINE_TAG);
+  return bucket->data[ind];
+}
+
+/**
+ * Key copier of pairs which adopt the caller's key.
+ * @return the key itself.
+ */
+static void *adopt_key (const_keyT key)
+{
+  return (keyT) key;
+}
+
+/**
+ * Value copier of pairs which adopt the caller's value.
+ * @return the value itself.
+ */
+static void *adopt_value (const_valueT value)
+{
+  return (valueT) value;
+}
+
+/**
+ * Key freer of pairs whose key goes back to the caller.
+ */
+static void forget_key (keyT *key)
+{
+  *key = NULL;
+}
+
+/**
+ * Value freer of pairs whose value goes back to the caller.
+ */
+static void forget_value (valueT *value)
+{
+  *value = NULL;
+}
+
+/**
+ * Allocates an entry holding copies of key and value, made by key_cpy and
+ * value_cpy, like pair_alloc.
+ * @return the pair of the entry, NULL if the allocation failed.
+ */
+static pair *entry_alloc (const_keyT key, const_valueT value,
+                          pair_key_cpy key_cpy, pair_value_cpy value_cpy,
+                          pair_key_cmp key_cmp, pair_value_cmp value_cmp,
+                          pair_key_free key_free, pair_value_free value_free)
+{
+  entry *in_entry = malloc (sizeof (entry));
+  if (in_entry == NULL)
+    return NULL;
+  pair *elem = &in_entry->elem;
+  elem->key = key_cpy (key);
+  elem->value = (elem->key == NULL) ? NULL : value_cpy (value);
+  if (elem->value == NULL)
+    {
+      if (elem->key != NULL)
+        key_free (&elem->key);
+      free (in_entry);
+      return NULL;
+    }
+  elem->key_cpy = key_cpy;
+  elem->value_cpy = value_cpy;
+  elem->key_cmp = key_cmp;
+  elem->value_cmp = value_cmp;
+  elem->key_free = key_free;
+  elem->value_free = value_free;
+  in_entry->refs = 1;
+  return elem;
+}
+
+/**
+ * Adds an owner to the entry of a pair. Used as the element copier of the
+ * bucket vectors, so copying a shared bucket copies pointers only.
+ * @param elem the pair of an entry.
+ * @return the same pair.
+ */
+static void *entry_share (const void *elem)
+{
+  __atomic_add_fetch (&((entry *) elem)->refs, 1, __ATOMIC_RELAXED);
+  return (void *) elem;
+}
+
+/**
+ * Drops an owner of the entry of a pair, and frees the entry with its key
+ * and value once it has none left.
+ * @param p_elem pointer to the pair of an entry, set to NULL.
+ */
+static void entry_release (void **p_elem)
+{
+  if (p_elem == NULL || *p_elem == NULL)
+    return;
+  entry *out = *p_elem;
+  *p_elem = NULL;
+  if (__atomic_sub_fetch (&out->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  out->elem.key_free (&out->elem.key);
+  out->elem.value_free (&out->elem.value);
+  free (out);
+}
+
+/**
+ * @param elem the pair of an entry.
+ * @return 1 if another bucket (of this map or of a clone) holds the entry.
+ */
+static int entry_is_shared (const pair *elem)
+{
+  return __atomic_load_n (&((const entry *) elem)->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/**
+ * @param elem a pair.
+ * @return a bucket holding only the pair, inline.
+ */
+static vector *inline_bucket (pair *elem)
+{
+  return (vector *) ((uintptr_t) elem | INLINE_TAG);
+}
+
+/**
+ * Allocates an empty bucket table.
+ * @param alloc the allocator of the table.
+ * @param buckets_capacity number of buckets.
+ * @return the table, NULL if the allocation failed.
+ */
+static vector **alloc_buckets (const allocator *alloc, size_t buckets_capacity)
+{
+  vector **buckets = (vector **) alloc->alloc
+      (buckets_capacity * sizeof (vector *), alloc->ctx);
+  if (buckets != NULL)
+    memset (buckets, 0, buckets_capacity * sizeof (vector *));
+  return buckets;
+}
+
+/**
+ * Free the vector in the bucket list and free the bucket itself.
+ * @param buckets The buckets to free.
+ * @param alloc the allocator of the buckets.
+ * @return 0
+ */
+static void delete_buckets (vector **buckets, size_t buckets_capacity,
+                            const allocator *alloc)
+{
+  for (size_t i = 0; i < buckets_capacity; i++)
+    if (bucket_is_inline (buckets[i]))
+      {
+        void *elem = bucket_at (buckets[i], 0);
+        entry_release (&elem);
+      }
+    else if (buckets[i] != NULL)
+      vector_free (&buckets[i]);
+  alloc->free (buckets, buckets_capacity * sizeof (vector *), alloc->ctx);
+  buckets = NULL;
+}
+
+/**
+ * Scatters the bits of a key's hash, so hashes which only differ in their
+ * high bits, or identity hashes, spread over the whole filter.
+ * @param hash the hash of a key.
+ * @return the mixed hash.
+ */
+static uint64_t filter_mix (uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53UL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+ * Adds a key to the filter of the hash map.
+ * @param block the hash map block, its filter must exist.
+ * @param key_hash the hash of the key to add.
+ */
+static void filter_add (hashmap_block *block, size_t key_hash)
+{
+  uint64_t hash = filter_mix (key_hash);
+  uint64_t *words = block->filter
+                    + (hash & (block->filter_blocks - 1)) * FILTER_BLOCK_WORDS;
+  hash = filter_mix (hash);
+  for (int i = 0; i < FILTER_HASHES; i++, hash >>= 9)
+    words[(hash & (FILTER_BLOCK_BITS - 1)) / 64] |= 1UL << (hash & 63);
+}
+
+/**
+ * Checks a key against the filter of the hash map.
+ * @param block the hash map block.
+ * @param key_hash the hash of the key to check.
+ * @return 0 if the key is surely not in the hash map, 1 otherwise.
+ */
+static int filter_may_contain (const hashmap_block *block, size_t key_hash)
+{
+  if (block->filter == NULL)
+    return 1;
+  uint64_t hash = filter_mix (key_hash);
+  const uint64_t *words = block->filter + (hash & (block->filter_blocks - 1))
+                                          * FILTER_BLOCK_WORDS;
+  hash = filter_mix (hash);
+  for (int i = 0; i < FILTER_HASHES; i++, hash >>= 9)
+    if (!(words[(hash & (FILTER_BLOCK_BITS - 1)) / 64] & (1UL << (hash & 63))))
+      return 0;
+  return 1;
+}
+
+/**
+ * Frees the filter of the hash map, if it has one.
+ * @param block the hash map block.
+ */
+static void filter_release (hashmap_block *block)
+{
+  if (block->filter_mem == NULL)
+    return;
+  block->alloc->free (block->filter_mem,
+                      block->filter_blocks * CACHE_LINE + CACHE_LINE,
+                      block->alloc->ctx);
+  block->filter_mem = NULL;
+  block->filter = NULL;
+  block->filter_blocks = 0;
+}
+
+/**
+ * Allocates an empty filter sized for the current capacity of the hash map,
+ * replacing the old one.
+ * @param block the hash map block.
+ * @return 1 if the filter was allocated, 0 otherwise (the hash map is then
+ * left without a filter).
+ */
+static int filter_alloc (hashmap_block *block)
+{
+  filter_release (block);
+  size_t bits = block->map.capacity * block->filter_bits;
+  size_t blocks = 1;
+  while (blocks * FILTER_BLOCK_BITS < bits)
+    blocks *= 2;
+  size_t mem_size = blocks * CACHE_LINE + CACHE_LINE;
+  void *mem = block->alloc->alloc (mem_size, block->alloc->ctx);
+  if (mem == NULL)
+    return 0;
+  memset (mem, 0, mem_size);
+  block->filter_mem = mem;
+  block->filter = (uint64_t *) (((uintptr_t) mem + CACHE_LINE - 1)
+                                & ~(uintptr_t) (CACHE_LINE - 1));
+  block->filter_blocks = blocks;
+  return 1;
+}
+
+/**
+ * Rebuilds the filter of the hash map from its keys, dropping the keys
+ * erased since the last rebuild. Called whenever the table is resized.
+ * @param block the hash map block.
+ */
+static void filter_rebuild (hashmap_block *block)
+{
+  if (block->filter_bits == 0 || !filter_alloc (block))
+    return;
+  for (size_t i = 0; i < block->map.capacity; i++)
+    for (size_t j = 0; j < bucket_size (block->map.buckets[i]); j++)
+      {
+        pair *curr = bucket_at (block->map.buckets[i], j);
+        filter_add (block, block->map.hash_func (curr->key));
+      }
+}
+
+/**
+ * Allocates a hash map block with no filter and no string keys.
+ * @param alloc the allocator of the block.
+ * @return the block, NULL if the allocation failed.
+ */
+static hashmap_block *alloc_block (const allocator *alloc)
+{
+  hashmap_block *block = (hashmap_block *) alloc->alloc
+      (sizeof (hashmap_block), alloc->ctx);
+  if (block == NULL)
+    return NULL;
+  block->alloc = alloc;
+  block->filter_bits = 0;
+  block->filter_blocks = 0;
+  block->filter = NULL;
+  block->filter_mem = NULL;
+  block->str_keys = NULL;
+  block->rehash_threads = 1;
+  return block;
+}
 
 /**
  * Allocates dynamically new hash map element.
@@ -10,15 +374,31 @@
  */
 hashmap *hashmap_alloc (hash_func func)
 {
-  hashmap *hash_map = (hashmap *) malloc (sizeof (hashmap));
-  if (hash_map == NULL)
+  return hashmap_alloc_ex (func, NULL);
+}
+
+/**
+ * Allocates dynamically new hash map element, whose bucket table and
+ * vectors come from the given allocator.
+ * @param func a function which "hashes" keys.
+ * @param alloc the allocator of the hash map, must outlive it.
+ * NULL for std_allocator.
+ * @return pointer to dynamically allocated hashmap.
+ * @if_fail return NULL.
+ */
+hashmap *hashmap_alloc_ex (hash_func func, const allocator *alloc)
+{
+  if (alloc == NULL)
+    alloc = &std_allocator;
+  hashmap_block *block = alloc_block (alloc);
+  if (block == NULL)
     return NULL;
-  hash_map->buckets = (vector **) calloc
-      (HASH_MAP_INITIAL_CAP, sizeof (vector *));
+  hashmap *hash_map = &block->map;
+  hash_map->buckets = alloc_buckets (alloc, HASH_MAP_INITIAL_CAP);
   if (hash_map->buckets == NULL)
     {
-      free (hash_map);
-      hash_map = NULL;
+      alloc->free (block, sizeof (hashmap_block), alloc->ctx);
+      block = NULL;
       return NULL;
     }
   hash_map->size = 0;
@@ -35,74 +415,428 @@ void hashmap_free (hashmap **p_hash_map)
 {
   if ((p_hash_map == NULL) || (*p_hash_map == NULL))
     return;
-  for (size_t i = 0; i < (*p_hash_map)->capacity; i++)
-    if ((*p_hash_map)->buckets[i] != NULL)
-      vector_free (&(*p_hash_map)->buckets[i]);
-  free ((*p_hash_map)->buckets);
-  free (*p_hash_map);
+  const allocator *alloc = HASHMAP_BLOCK (*p_hash_map)->alloc;
+  filter_release (HASHMAP_BLOCK (*p_hash_map));
+  str_arena_free (&HASHMAP_BLOCK (*p_hash_map)->str_keys);
+  delete_buckets ((*p_hash_map)->buckets, (*p_hash_map)->capacity, alloc);
+  alloc->free (HASHMAP_BLOCK (*p_hash_map), sizeof (hashmap_block),
+               alloc->ctx);
   *p_hash_map = NULL;
 }
 
 /**
- * Free the vector in the bucket list and free the bucket itself.
+ * Makes sure the bucket is owned by a single hash map, copying it if it is
+ * shared with a clone. The copy shares the entries of the bucket, so only
+ * its array of pointers is copied.
+ * @param bucket pointer to a bucket of the hash map.
+ * @return 1 if the bucket can be mutated, 0 otherwise.
+ */
+static int unshare_bucket (vector **bucket)
+{
+  if (bucket_is_inline (*bucket) || !vector_is_shared (*bucket))
+    return 1;
+  vector *copy = vector_copy (*bucket);
+  if (copy == NULL)
+    return 0;
+  vector_free (bucket);
+  *bucket = copy;
+  return 1;
+}
+
+/**
+ * Makes sure a pair of the bucket is owned by this hash map only, so its
+ * value can be modified: a pair shared with a clone is replaced by a copy.
+ * @param bucket pointer to a bucket of the hash map.
+ * @param ind index of the pair in the bucket.
+ * @return the pair, NULL if it could not be copied.
+ */
+static pair *unshare_pair (vector **bucket, size_t ind)
+{
+  if (!unshare_bucket (bucket))
+    return NULL;
+  pair *elem = bucket_at (*bucket, ind);
+  if (!entry_is_shared (elem))
+    return elem;
+  pair *copy = entry_alloc (elem->key, elem->value, elem->key_cpy,
+                            elem->value_cpy, elem->key_cmp, elem->value_cmp,
+                            elem->key_free, elem->value_free);
+  if (copy == NULL)
+    return NULL;
+  if (bucket_is_inline (*bucket))
+    *bucket = inline_bucket (copy);
+  else
+    (*bucket)->data[ind] = copy;
+  void *shared = elem;
+  entry_release (&shared);
+  return copy;
+}
+
+/**
+ * Adds a pair to a bucket without copying it, spilling an inline bucket to
+ * a vector.
+ * @param bucket pointer to a bucket.
+ * @param elem the pair, which the bucket takes ownership of.
+ * @param alloc the allocator of the hash map.
+ * @return 1 if the pair was added, 0 otherwise (the pair then still
+ * belongs to the caller).
+ */
+static int bucket_push_take (vector **bucket, pair *elem,
+                             const allocator *alloc)
+{
+  if (*bucket == NULL)
+    {
+      *bucket = inline_bucket (elem);
+      return 1;
+    }
+  if (bucket_is_inline (*bucket))
+    {
+      vector *spill = vector_alloc_ex (entry_share, pair_cmp, entry_release,
+                                       alloc);
+      if (spill == NULL || !vector_push_back_take (spill,
+                                                   bucket_at (*bucket, 0)))
+        {
+          vector_free (&spill);
+          return 0;
+        }
+      *bucket = spill;
+    }
+  return unshare_bucket (bucket) && vector_push_back_take (*bucket, elem);
+}
+
+/**
+ * Removes a pair from a bucket without freeing it. A vector left with a
+ * single pair goes back inline, an empty one is freed.
+ * @param bucket pointer to a bucket.
+ * @param ind index of the pair in the bucket.
+ * @return the removed pair, NULL if the removing failed (the bucket is
+ * then left as it was).
+ */
+static pair *bucket_take (vector **bucket, size_t ind)
+{
+  if (bucket_is_inline (*bucket))
+    {
+      pair *elem = bucket_at (*bucket, 0);
+      *bucket = NULL;
+      return elem;
+    }
+  if (!unshare_bucket (bucket))
+    return NULL;
+  if (2 < (*bucket)->size)
+    return vector_take (*bucket, ind);
+  // The vector is about to be freed, so its pairs are moved straight out
+  // of it rather than through vector_take, whose shrinking may fail.
+  pair *elem = (*bucket)->data[ind];
+  pair *last = ((*bucket)->size == 2) ? (*bucket)->data[1 - ind] : NULL;
+  (*bucket)->size = 0;
+  vector_free (bucket);
+  *bucket = (last == NULL) ? NULL : inline_bucket (last);
+  return elem;
+}
+
+/**
+ * Frees the bucket table and vectors, but not the pairs, which are owned
+ * by another bucket table.
  * @param buckets The buckets to free.
- * @return 0
+ * @param buckets_capacity number of buckets.
+ * @param alloc the allocator of the buckets.
  */
-void delete_buckets (vector **buckets, size_t buckets_capacity)
+static void release_buckets (vector **buckets, size_t buckets_capacity,
+                             const allocator *alloc)
 {
   for (size_t i = 0; i < buckets_capacity; i++)
-    if (buckets[i] != NULL)
-      vector_free (&buckets[i]);
-  free (buckets);
-  buckets = NULL;
+    if (buckets[i] != NULL && !bucket_is_inline (buckets[i]))
+      {
+        buckets[i]->size = 0;
+        vector_free (&buckets[i]);
+      }
+  alloc->free (buckets, buckets_capacity * sizeof (vector *), alloc->ctx);
 }
 
 /**
- * In case the hash map need to be reorganized. Make new buckets hash-table.
- * * @param hash_map the hash map to rehash.
- * @param action 1 to magnify, 0 to minimize.
- * @return new buckets for re-hashing table worked, NULL otherwise
+ * A pair on its way to a bucket of the new table.
  */
-vector **resize_buckets (const hashmap *hash_map, int magnify)
+typedef struct rehash_entry
 {
-  size_t new_buckets_capacity;
-  if (magnify)
-    new_buckets_capacity = (hash_map->capacity * HASH_MAP_GROWTH_FACTOR);
-  else  // Minimize Case
-    new_buckets_capacity = (hash_map->capacity / HASH_MAP_GROWTH_FACTOR);
+  size_t ind;
+  pair *elem;
+} rehash_entry;
 
-  vector **new_buckets = calloc (new_buckets_capacity, sizeof (vector *));
-  if (new_buckets == NULL)
-    return NULL;
+/**
+ * The pairs one worker found for one partition of the new table.
+ */
+typedef struct rehash_stage
+{
+  rehash_entry *entries;
+  size_t size;
+  size_t capacity;
+} rehash_stage;
 
-  vector **old_buckets = hash_map->buckets;
-  size_t new_ind;
-  pair *curr_pair;
+/**
+ * State shared by the workers of a rehash. Worker t scans the old buckets
+ * of range t into stages[t * nthreads + p], p being the partition of the
+ * new table each pair falls in; worker p then fills partition p from
+ * stages[t * nthreads + p] of every t. No two workers write the same
+ * memory, so no locks are needed.
+ */
+typedef struct rehash_ctx
+{
+  hashmap *hash_map;
+  const allocator *alloc;
+  vector **new_buckets;
+  size_t new_capacity;
+  size_t nthreads;
+  rehash_stage *stages;
+} rehash_ctx;
 
-  for (size_t i = 0; i < hash_map->capacity; i++)
-    if (hash_map->buckets[i] != NULL)
-      for (size_t j = 0; j < old_buckets[i]->size; j++)
+/**
+ * One worker of a rehash.
+ */
+typedef struct rehash_worker
+{
+  rehash_ctx *ctx;
+  size_t id;
+  int failed;
+  pthread_t thread;
+} rehash_worker;
+
+/**
+ * Appends a pair to a stage.
+ * @return 1 if the pair was appended, 0 otherwise.
+ */
+static int stage_push (rehash_stage *stage, size_t ind, pair *elem,
+                       const allocator *alloc)
+{
+  if (stage->size == stage->capacity)
+    {
+      size_t capacity = (stage->capacity == 0) ? VECTOR_INITIAL_CAP
+                                               : stage->capacity * 2;
+      rehash_entry *entries = alloc->realloc
+          (stage->entries, stage->capacity * sizeof (rehash_entry),
+           capacity * sizeof (rehash_entry), alloc->ctx);
+      if (entries == NULL)
+        return 0;
+      stage->entries = entries;
+      stage->capacity = capacity;
+    }
+  stage->entries[stage->size].ind = ind;
+  stage->entries[stage->size].elem = elem;
+  stage->size++;
+  return 1;
+}
+
+/**
+ * First phase of a rehash: sorts the pairs of a range of the old table by
+ * partition of the new table. Shared buckets are copied first, since their
+ * pairs are about to move; the pairs themselves stay shared.
+ * @param arg the rehash_worker.
+ * @return NULL
+ */
+static void *rehash_scatter (void *arg)
+{
+  rehash_worker *worker = arg;
+  rehash_ctx *ctx = worker->ctx;
+  hashmap *hash_map = ctx->hash_map;
+  size_t range = (hash_map->capacity + ctx->nthreads - 1) / ctx->nthreads;
+  size_t partition = (ctx->new_capacity + ctx->nthreads - 1) / ctx->nthreads;
+  size_t from = worker->id * range;
+  size_t to = (from + range < hash_map->capacity) ? from + range
+                                                   : hash_map->capacity;
+  for (size_t i = from; i < to; i++)
+    {
+      if (!unshare_bucket (&hash_map->buckets[i]))
         {
-          curr_pair = old_buckets[i]->data[j];
-          new_ind = hash_map->hash_func (curr_pair->key)
-                    & (new_buckets_capacity - 1);
-          if (new_buckets[new_ind] == NULL) // Need allocate new vector
-            {
-              new_buckets[new_ind] = vector_alloc
-                  (pair_copy, pair_cmp, pair_free);
-              if (new_buckets[new_ind] == NULL) // Allocation didn't work
-                {
-                  delete_buckets (new_buckets, new_buckets_capacity);
-                  return NULL;
-                }
-            }
-          if (!vector_push_back (new_buckets[new_ind], curr_pair))
+          worker->failed = 1;
+          return NULL;
+        }
+      for (size_t j = 0; j < bucket_size (hash_map->buckets[i]); j++)
+        {
+          pair *elem = bucket_at (hash_map->buckets[i], j);
+          size_t ind = hash_map->hash_func (elem->key)
+                       & (ctx->new_capacity - 1);
+          rehash_stage *stage = ctx->stages + worker->id * ctx->nthreads
+                                + ind / partition;
+          if (!stage_push (stage, ind, elem, ctx->alloc))
             {
-              delete_buckets (new_buckets, new_buckets_capacity);
+              worker->failed = 1;
               return NULL;
             }
         }
-  return new_buckets;
+    }
+  return NULL;
+}
+
+/**
+ * Second phase of a rehash: moves the pairs found by all the workers for
+ * one partition of the new table to their buckets.
+ * @param arg the rehash_worker.
+ * @return NULL
+ */
+static void *rehash_gather (void *arg)
+{
+  rehash_worker *worker = arg;
+  rehash_ctx *ctx = worker->ctx;
+  for (size_t t = 0; t < ctx->nthreads; t++)
+    {
+      rehash_stage *stage = ctx->stages + t * ctx->nthreads + worker->id;
+      for (size_t i = 0; i < stage->size; i++)
+        if (!bucket_push_take (&ctx->new_buckets[stage->entries[i].ind],
+                               stage->entries[i].elem, ctx->alloc))
+          {
+            worker->failed = 1;
+            return NULL;
+          }
+    }
+  return NULL;
+}
+
+/**
+ * Runs a phase of the rehash on every worker, the first one on the calling
+ * thread.
+ * @return 1 if every worker succeeded, 0 otherwise.
+ */
+static int rehash_run (rehash_worker *workers, size_t nthreads,
+                       void *(*phase) (void *))
+{
+  int ok = 1;
+  size_t started = 1;
+  for (; started < nthreads; started++)
+    if (pthread_create (&workers[started].thread, NULL, phase,
+                        &workers[started]) != 0)
+      break;
+  phase (&workers[0]);
+  // Threads which could not be started are run here.
+  for (size_t t = started; t < nthreads; t++)
+    phase (&workers[t]);
+  for (size_t t = 1; t < started; t++)
+    pthread_join (workers[t].thread, NULL);
+  for (size_t t = 0; t < nthreads; t++)
+    ok = ok && !workers[t].failed;
+  return ok;
+}
+
+/**
+ * Moves all the pairs of the hash map to a new bucket table. The pairs
+ * are moved, not copied. The old table is split into ranges, one per
+ * thread, and the new table into partitions, one per thread.
+ * With more than one thread, the hash function and the allocator of the
+ * map must be thread safe. The pairs' copy and free functions are not
+ * called: buckets shared with a clone are copied by adding owners to
+ * their pairs.
+ * @param hash_map a hash map.
+ * @param new_capacity number of buckets of the new table, a power of 2.
+ * @param nthreads number of threads to use, including the calling one.
+ * At most one per bucket of the smaller table is started.
+ * @return 1 if the hash map was rehashed, 0 otherwise (the hash map is
+ * then left as it was).
+ */
+int hashmap_rehash (hashmap *hash_map, size_t new_capacity, size_t nthreads)
+{
+  if (hash_map == NULL || new_capacity == 0
+      || (new_capacity & (new_capacity - 1)) != 0 || nthreads == 0)
+    return 0;
+  size_t min_capacity = (new_capacity < hash_map->capacity)
+                        ? new_capacity : hash_map->capacity;
+  if (min_capacity < nthreads)
+    nthreads = min_capacity;
+  const allocator *alloc = HASHMAP_BLOCK (hash_map)->alloc;
+  rehash_ctx ctx = {hash_map, alloc, NULL, new_capacity, nthreads, NULL};
+  size_t stages_size = nthreads * nthreads * sizeof (rehash_stage);
+  rehash_worker *workers = alloc->alloc (nthreads * sizeof (rehash_worker),
+                                         alloc->ctx);
+  ctx.stages = alloc->alloc (stages_size, alloc->ctx);
+  ctx.new_buckets = alloc_buckets (alloc, new_capacity);
+  int ok = workers != NULL && ctx.stages != NULL && ctx.new_buckets != NULL;
+  if (ok)
+    {
+      memset (ctx.stages, 0, stages_size);
+      for (size_t t = 0; t < nthreads; t++)
+        {
+          workers[t].ctx = &ctx;
+          workers[t].id = t;
+          workers[t].failed = 0;
+        }
+      ok = rehash_run (workers, nthreads, rehash_scatter)
+           && rehash_run (workers, nthreads, rehash_gather);
+    }
+
+  if (ctx.stages != NULL)
+    {
+      for (size_t i = 0; i < nthreads * nthreads; i++)
+        alloc->free (ctx.stages[i].entries,
+                     ctx.stages[i].capacity * sizeof (rehash_entry),
+                     alloc->ctx);
+      alloc->free (ctx.stages, stages_size, alloc->ctx);
+    }
+  if (workers != NULL)
+    alloc->free (workers, nthreads * sizeof (rehash_worker), alloc->ctx);
+  if (!ok)
+    {
+      if (ctx.new_buckets != NULL)
+        release_buckets (ctx.new_buckets, new_capacity, alloc);
+      return 0;
+    }
+  release_buckets (hash_map->buckets, hash_map->capacity, alloc);
+  hash_map->buckets = ctx.new_buckets;
+  hash_map->capacity = new_capacity;
+  filter_rebuild (HASHMAP_BLOCK (hash_map));
+  return 1;
+}
+
+/**
+ * Sets the number of threads which grow and shrink the table of the hash
+ * map. Small tables are always rehashed on the calling thread.
+ * @param hash_map a hash map.
+ * @param nthreads number of threads, including the calling one.
+ * @return 1 if the number was set, 0 otherwise.
+ */
+int hashmap_set_rehash_threads (hashmap *hash_map, size_t nthreads)
+{
+  if (hash_map == NULL || nthreads == 0)
+    return 0;
+  HASHMAP_BLOCK (hash_map)->rehash_threads = nthreads;
+  return 1;
+}
+
+/**
+ * In case the hash map need to be reorganized, rehashes it to a new
+ * bucket table.
+ * @param hash_map the hash map to rehash.
+ * @param new_capacity number of buckets of the new table.
+ * @return 1 if re-hashing table worked, 0 otherwise.
+ */
+static int resize_buckets (hashmap *hash_map, size_t new_capacity)
+{
+  size_t nthreads = HASHMAP_BLOCK (hash_map)->rehash_threads;
+  size_t max_threads = hash_map->capacity / REHASH_MIN_BUCKETS_PER_THREAD;
+  if (max_threads < nthreads)
+    nthreads = (max_threads == 0) ? 1 : max_threads;
+  return hashmap_rehash (hash_map, new_capacity, nthreads);
+}
+
+/**
+ * Adds a pair whose key is not in the hash map, growing the table first
+ * if needed. The hash map takes ownership of the pair.
+ * @param hash_map a hash map.
+ * @param elem the pair to be added.
+ * @return 1 if the pair was added, 0 otherwise (the pair then still
+ * belongs to the caller).
+ */
+static int place_pair (hashmap *hash_map, pair *elem)
+{
+  if (HASH_MAP_MAX_LOAD_FACTOR < ((double) (hash_map->size + 1))
+                                 / ((double) hash_map->capacity)
+      && !resize_buckets (hash_map,
+                          hash_map->capacity * HASH_MAP_GROWTH_FACTOR))
+    return 0;
+  size_t hash = hash_map->hash_func (elem->key);
+  size_t ind = hash & (hash_map->capacity - 1);
+  if (!bucket_push_take (&hash_map->buckets[ind], elem,
+                         HASHMAP_BLOCK (hash_map)->alloc))
+    return 0;
+  hash_map->size++;
+  if (HASHMAP_BLOCK (hash_map)->filter != NULL)
+    filter_add (HASHMAP_BLOCK (hash_map), hash);
+  return 1;
 }
 
 /**
@@ -119,54 +853,18 @@ int hashmap_insert (hashmap *hash_map, const pair *in_pair)
     return 0;
   if (hashmap_at (hash_map, in_pair->key) != NULL)
     return 0;
-  size_t ind;
-  hash_map->size++;
-  if (HASH_MAP_MAX_LOAD_FACTOR < hashmap_get_load_factor (hash_map))
+  void *copy = entry_alloc (in_pair->key, in_pair->value, in_pair->key_cpy,
+                            in_pair->value_cpy, in_pair->key_cmp,
+                            in_pair->value_cmp, in_pair->key_free,
+                            in_pair->value_free);
+  if (copy == NULL)
+    return 0;
+  if (!place_pair (hash_map, copy))
     {
-      ind = hash_map->hash_func (in_pair->key)
-            & ((hash_map->capacity * HASH_MAP_GROWTH_FACTOR) - 1);
-
-      vector **new_buckets = resize_buckets (hash_map, MAGNIFY);
-      if (new_buckets == NULL)
-        {
-          hash_map->size--;
-          return 0;
-        }
-      if (new_buckets[ind] == NULL)
-        {
-          new_buckets[ind] = vector_alloc (pair_copy, pair_cmp, pair_free);
-          if (new_buckets[ind] == NULL)
-            {
-              hash_map->size--;
-              return 0;
-            }
-        }
-      if (vector_push_back (new_buckets[ind], in_pair))
-        {
-          delete_buckets (hash_map->buckets, hash_map->capacity);
-          hash_map->capacity *= HASH_MAP_GROWTH_FACTOR;
-          hash_map->buckets = new_buckets;
-          return 1;
-        }
-      hash_map->size--;
+      entry_release (&copy);
       return 0;
     }
-// Below its case Not needed Resize Hashtable
-  ind = hash_map->hash_func (in_pair->key) & (hash_map->capacity - 1);
-  if (hash_map->buckets[ind] == NULL) // Case of allocate new vector
-    {
-      hash_map->buckets[ind] =
-          vector_alloc (pair_copy, pair_cmp, pair_free);
-      if (hash_map->buckets[ind] == NULL)
-        {
-          hash_map->size--;
-          return 0;
-        }
-    }
-  if (vector_push_back (hash_map->buckets[ind], in_pair))
-    return 1;
-  hash_map->size--;
-  return 0;
+  return 1;
 }
 
 /**
@@ -180,18 +878,61 @@ valueT hashmap_at (const hashmap *hash_map, const_keyT key)
 {
   if (hash_map == NULL || key == NULL)
     return NULL;
-  size_t ind = hash_map->hash_func (key) & (hash_map->capacity - 1);
+  size_t hash = hash_map->hash_func (key);
+  if (!filter_may_contain (HASHMAP_BLOCK (hash_map), hash))
+    return NULL;
+  const vector *bucket = hash_map->buckets[hash & (hash_map->capacity - 1)];
   pair *curr = NULL;
-  if (hash_map->buckets[ind] != NULL)
-    for (size_t i = 0; i < hash_map->buckets[ind]->size; i++)
-      {
-        curr = hash_map->buckets[ind]->data[i];
-        if (curr->key_cmp (key, curr->key))
-          return curr->value;
-      }
+  for (size_t i = 0; i < bucket_size (bucket); i++)
+    {
+      curr = bucket_at (bucket, i);
+      if (curr->key_cmp (key, curr->key))
+        return curr->value;
+    }
   return NULL;
 }
 
+/**
+ * Finds the pair of a key.
+ * @param hash_map a hash map.
+ * @param key the key.
+ * @param ind set to the index of the bucket of the key.
+ * @param pos set to the index of the pair in its bucket.
+ * @return the pair if the key is in the map, NULL otherwise.
+ */
+static pair *find_pair (const hashmap *hash_map, const_keyT key, size_t *ind,
+                        size_t *pos)
+{
+  *ind = hash_map->hash_func (key) & (hash_map->capacity - 1);
+  for (*pos = 0; *pos < bucket_size (hash_map->buckets[*ind]); (*pos)++)
+    {
+      pair *curr = bucket_at (hash_map->buckets[*ind], *pos);
+      if (curr->key_cmp (curr->key, key))
+        return curr;
+    }
+  return NULL;
+}
+
+/**
+ * Removes a pair from the hash map, shrinking the table if it got sparse.
+ * The caller takes over the map's owner of the pair's entry.
+ * @param hash_map a hash map.
+ * @param ind index of the bucket of the pair.
+ * @param pos index of the pair in its bucket.
+ * @return the removed pair, NULL if the removing failed.
+ */
+static pair *remove_pair (hashmap *hash_map, size_t ind, size_t pos)
+{
+  pair *elem = bucket_take (&hash_map->buckets[ind], pos);
+  if (elem == NULL)
+    return NULL;
+  hash_map->size--;
+  // Failing to shrink leaves a valid, sparser table.
+  if (hashmap_get_load_factor (hash_map) < HASH_MAP_MIN_LOAD_FACTOR)
+    resize_buckets (hash_map, hash_map->capacity / HASH_MAP_GROWTH_FACTOR);
+  return elem;
+}
+
 /**
  * The function erases the pair associated with key.
  * @param hash_map a hash map.
@@ -201,56 +942,139 @@ valueT hashmap_at (const hashmap *hash_map, const_keyT key)
  */
 int hashmap_erase (hashmap *hash_map, const_keyT key)
 {
-
   if (hash_map == NULL || key == NULL)
-      return 0;
-  if (hashmap_at (hash_map, key) == NULL)
-      return 0;
-
+    return 0;
+  size_t ind, pos;
+  if (find_pair (hash_map, key, &ind, &pos) == NULL)
+    return 0;
+  void *elem = remove_pair (hash_map, ind, pos);
+  if (elem == NULL)
+    return 0;
+  entry_release (&elem);
+  return 1;
+}
 
+/**
+ * Inserts the caller's pair to the hash map without copying its key and
+ * value. On success the hash map takes ownership of the pair and *p_pair
+ * is set to NULL.
+ * @param hash_map the hash map to be inserted with new element.
+ * @param p_pair pointer to a dynamically allocated pair (see pair_alloc).
+ * @return returns 1 for successful insertion, 0 otherwise (the pair then
+ * still belongs to the caller).
+ */
+int hashmap_insert_take (hashmap *hash_map, pair **p_pair)
+{
+  if (hash_map == NULL || p_pair == NULL || *p_pair == NULL)
+    return 0;
+  pair *in_pair = *p_pair;
+  if (hashmap_at (hash_map, in_pair->key) != NULL)
+    return 0;
+  // The entry adopts the key and value of the pair.
+  pair *elem = entry_alloc (in_pair->key, in_pair->value, adopt_key,
+                            adopt_value, in_pair->key_cmp, in_pair->value_cmp,
+                            in_pair->key_free, in_pair->value_free);
+  if (elem == NULL)
+    return 0;
+  elem->key_cpy = in_pair->key_cpy;
+  elem->value_cpy = in_pair->value_cpy;
+  if (!place_pair (hash_map, elem))
+    {
+      free (elem);
+      return 0;
+    }
+  in_pair->key_free = forget_key;
+  in_pair->value_free = forget_value;
+  void *shell = in_pair;
+  pair_free (&shell);
+  *p_pair = NULL;
+  return 1;
+}
 
-  size_t ind = hash_map->hash_func (key) & (hash_map->capacity - 1);
-  vector *curr_vector = hash_map->buckets[ind];
-  pair *curr_pair;
-  hash_map->size--;
-  if (hashmap_get_load_factor (hash_map) < HASH_MAP_MIN_LOAD_FACTOR)
+/**
+ * Inserts a pair of copies of key and value to the hash map. Unlike
+ * hashmap_insert, the pair is built once, by the hash map, and nothing is
+ * allocated if key is already in the map.
+ * @param hash_map the hash map to be inserted with new element.
+ * @param key the key of the new pair.
+ * @param value the value of the new pair.
+ * @return returns 1 for successful insertion, 0 otherwise.
+ */
+int hashmap_emplace (hashmap *hash_map, const_keyT key, const_valueT value,
+                     pair_key_cpy key_cpy, pair_value_cpy value_cpy,
+                     pair_key_cmp key_cmp, pair_value_cmp value_cmp,
+                     pair_key_free key_free, pair_value_free value_free)
+{
+  if (hash_map == NULL || key == NULL || value == NULL)
+    return 0;
+  if (hashmap_at (hash_map, key) != NULL)
+    return 0;
+  void *elem = entry_alloc (key, value, key_cpy, value_cpy, key_cmp,
+                            value_cmp, key_free, value_free);
+  if (elem == NULL)
+    return 0;
+  if (!place_pair (hash_map, elem))
     {
-      vector **new_buckets = resize_buckets (hash_map, MINIMIZE);
-      if (new_buckets == NULL)
-        {
-          hash_map->size++;
-          return 0;
-        }
+      entry_release (&elem);
+      return 0;
+    }
+  return 1;
+}
 
-      ind = hash_map->hash_func (key)
-            & ((hash_map->capacity / HASH_MAP_GROWTH_FACTOR) - 1);
-      curr_vector = new_buckets[ind];
-      for (size_t i = 0; i < curr_vector->size; i++)
+/**
+ * Removes the pair associated with key from the hash map and hands it to
+ * the caller, who takes ownership of it. The key and value are not copied
+ * unless a clone still holds the pair.
+ * On a map of byte string keys (see hashmap_alloc_str), the key of the
+ * pair points into the map's arena: it is not the caller's, and it dangles
+ * once the map is freed, so the caller must be done with it by then.
+ * @param hash_map a hash map.
+ * @param key a key of the pair to be removed.
+ * @return the removed pair, NULL if key is not in the map or the removing
+ * failed.
+ */
+pair *hashmap_erase_take (hashmap *hash_map, const_keyT key)
+{
+  if (hash_map == NULL || key == NULL)
+    return NULL;
+  size_t ind, pos;
+  pair *curr = find_pair (hash_map, key, &ind, &pos);
+  if (curr == NULL)
+    return NULL;
+  const vector *bucket = hash_map->buckets[ind];
+  int shared = entry_is_shared (curr)
+               || (!bucket_is_inline (bucket) && vector_is_shared (bucket));
+  // The caller's pair is made before the map's one is removed, so a failed
+  // allocation leaves the map as it was.
+  pair *out = shared ? pair_copy (curr)
+                     : pair_alloc (curr->key, curr->value, adopt_key,
+                                   adopt_value, curr->key_cmp,
+                                   curr->value_cmp, curr->key_free,
+                                   curr->value_free);
+  if (out == NULL)
+    return NULL;
+  void *elem = remove_pair (hash_map, ind, pos);
+  if (elem == NULL)
+    {
+      if (!shared)
         {
-          curr_pair = curr_vector->data[i];
-          if (curr_pair->key_cmp (curr_pair->key, key))
-            {
-              if (vector_erase (curr_vector, i))
-                {
-                  delete_buckets (hash_map->buckets, hash_map->capacity);
-                  hash_map->buckets = new_buckets;
-                  hash_map->capacity /= HASH_MAP_GROWTH_FACTOR;
-                  return 1;
-                }
-              return 0;
-            }
+          out->key_free = forget_key;
+          out->value_free = forget_value;
         }
+      void *unused = out;
+      pair_free (&unused);
+      return NULL;
     }
-
-  for (size_t i = 0; i < curr_vector->size; i++)
+  if (shared)
+    entry_release (&elem);
+  else
     {
-      curr_pair = curr_vector->data[i];
-      if (curr_pair->key_cmp (curr_pair->key, key))
-        if (vector_erase (curr_vector, i))
-          return 1;
+      // The caller's pair took over the key and value of the entry.
+      out->key_cpy = curr->key_cpy;
+      out->value_cpy = curr->value_cpy;
+      free (elem);
     }
-  hash_map->size++;
-  return 0;
+  return out;
 }
 
 /**
@@ -279,7 +1103,7 @@ double hashmap_get_load_factor (const hashmap *hash_map)
  * @param keyT_func a function that checks a condition on keyT and
  * return 1 if true, 0 else
  * @param valT_func a function that modifies valueT, in-place
- * @return number of changed values
+ * @return number of changed values, -1 if the function failed.
  */
 int hashmap_apply_if
     (const hashmap *hash_map, keyT_func keyT_func, valueT_func valT_func)
@@ -288,17 +1112,306 @@ int hashmap_apply_if
     return -1;
   int counter = 0;
   for (size_t i = 0; i < hash_map->capacity; i++)
-    if (hash_map->buckets[i] != NULL)
+    for (size_t j = 0; j < bucket_size (hash_map->buckets[i]); j++)
       {
-        for (size_t j = 0; j < hash_map->buckets[i]->size; j++)
+        pair *curr = bucket_at (hash_map->buckets[i], j);
+        if (keyT_func (curr->key) == 1)
           {
-            pair *curr = hash_map->buckets[i]->data[j];
-            if (keyT_func (curr->key) == 1)
-              {
-                valT_func (curr->value);
-                counter++;
-              }
+            curr = unshare_pair (&hash_map->buckets[i], j);
+            if (curr == NULL)
+              return -1;
+            valT_func (curr->value);
+            counter++;
           }
       }
   return counter;
-}
\ No newline at end of file
+}
+
+/**
+ * Calls a function on every pair of the hash map, in bucket order.
+ * @param hash_map a hash map.
+ * @param visit function called with each pair and ctx; returning 0 stops
+ * the walk.
+ * @param ctx passed to visit.
+ * @return number of pairs visited, -1 if the function failed or visit
+ * stopped the walk.
+ */
+int hashmap_for_each (const hashmap *hash_map, pair_visit visit, void *ctx)
+{
+  if (hash_map == NULL || visit == NULL)
+    return -1;
+  int counter = 0;
+  for (size_t i = 0; i < hash_map->capacity; i++)
+    for (size_t j = 0; j < bucket_size (hash_map->buckets[i]); j++)
+      {
+        if (!visit (bucket_at (hash_map->buckets[i], j), ctx))
+          return -1;
+        counter++;
+      }
+  return counter;
+}
+
+/**
+ * Allocates dynamically a hash map which shares the buckets, and through
+ * them the pairs, of the given hash map. Only the bucket table is copied,
+ * so cloning takes O(buckets) time and copies no pair. A shared bucket is
+ * copied by whichever map inserts to it, erases from it or modifies its
+ * values first, and the copy still shares the pairs. A pair is copied
+ * only when a map modifies its value (see hashmap_apply_if) or hands it to
+ * the caller (see hashmap_erase_take) while the other map holds it.
+ * An inline pair gets a second owner, and the clone's bucket points to
+ * the same pair. The given map is not modified: only the owner counts of
+ * its pairs and vectors change.
+ * A clone of a map of byte string keys adds its new keys to an arena of
+ * its own, so once cloned, the clone and the given map may be mutated on
+ * different threads.
+ * @param hash_map the hash map to clone.
+ * @return pointer to dynamically allocated clone of the hash map.
+ * @if_fail return NULL.
+ */
+hashmap *hashmap_clone_cow (const hashmap *hash_map)
+{
+  if (hash_map == NULL)
+    return NULL;
+  const allocator *alloc = HASHMAP_BLOCK (hash_map)->alloc;
+  hashmap_block *block = alloc_block (alloc);
+  if (block == NULL)
+    return NULL;
+  hashmap *clone = &block->map;
+  clone->buckets = alloc_buckets (alloc, hash_map->capacity);
+  if (clone->buckets == NULL)
+    {
+      alloc->free (block, sizeof (hashmap_block), alloc->ctx);
+      block = NULL;
+      return NULL;
+    }
+  clone->size = hash_map->size;
+  clone->capacity = hash_map->capacity;
+  clone->hash_func = hash_map->hash_func;
+  for (size_t i = 0; i < hash_map->capacity; i++)
+    if (bucket_is_inline (hash_map->buckets[i]))
+      {
+        entry_share (bucket_at (hash_map->buckets[i], 0));
+        clone->buckets[i] = hash_map->buckets[i];
+      }
+    else
+      clone->buckets[i] = vector_share (hash_map->buckets[i]);
+  const hashmap_block *orig = HASHMAP_BLOCK (hash_map);
+  if (orig->str_keys != NULL)
+    {
+      block->str_keys = str_arena_fork (orig->str_keys);
+      if (block->str_keys == NULL)
+        {
+          hashmap_free (&clone);
+          return NULL;
+        }
+    }
+  block->rehash_threads = orig->rehash_threads;
+  block->filter_bits = orig->filter_bits;
+  if (orig->filter != NULL && filter_alloc (block))
+    memcpy (block->filter, orig->filter, orig->filter_blocks * CACHE_LINE);
+  return clone;
+}
+
+/**
+ * Puts a Bloom filter in front of the hash map, so lookups of most missing
+ * keys return after reading a single cache line. The filter is updated on
+ * insertion and rebuilt whenever the table is resized, which also clears
+ * the keys erased since.
+ * @param hash_map a hash map.
+ * @param bits_per_bucket size of the filter in bits per bucket of the
+ * table, 0 to remove the filter. 8 bits give about 2% false positives at
+ * the maximal load factor.
+ * @return 1 if the filter was set up, 0 otherwise.
+ */
+int hashmap_set_filter (hashmap *hash_map, size_t bits_per_bucket)
+{
+  if (hash_map == NULL)
+    return 0;
+  hashmap_block *block = HASHMAP_BLOCK (hash_map);
+  block->filter_bits = bits_per_bucket;
+  if (bits_per_bucket == 0)
+    {
+      filter_release (block);
+      return 1;
+    }
+  filter_rebuild (block);
+  return block->filter != NULL;
+}
+
+/**
+ * This function returns the memory taken by the filter of the hash map.
+ * @param hash_map a hash map.
+ * @return the size of the filter in bytes, 0 if there is no filter.
+ */
+size_t hashmap_filter_size (const hashmap *hash_map)
+{
+  if (hash_map == NULL || HASHMAP_BLOCK (hash_map)->filter == NULL)
+    return 0;
+  return HASHMAP_BLOCK (hash_map)->filter_blocks * CACHE_LINE + CACHE_LINE;
+}
+
+/**
+ * Allocates dynamically new hash map element whose keys are byte strings.
+ * The keys are kept, once each, in an append-only arena of the map and
+ * are compared by hash and length before their bytes.
+ * Use the *_str functions to access the map.
+ * @param alloc the allocator of the hash map, must outlive it.
+ * NULL for std_allocator.
+ * @return pointer to dynamically allocated hashmap.
+ * @if_fail return NULL.
+ */
+hashmap *hashmap_alloc_str (const allocator *alloc)
+{
+  hashmap *hash_map = hashmap_alloc_ex (str_key_hash, alloc);
+  if (hash_map == NULL)
+    return NULL;
+  hashmap_block *block = HASHMAP_BLOCK (hash_map);
+  block->str_keys = str_arena_alloc (block->alloc);
+  if (block->str_keys == NULL)
+    hashmap_free (&hash_map);
+  return hash_map;
+}
+
+/**
+ * Finds the pair of a byte string key.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key.
+ * @param len number of bytes.
+ * @param hash str_hash of the key.
+ * @return the pair if the key is in the map, NULL otherwise.
+ */
+static pair *find_str (const hashmap *hash_map, const char *key, size_t len,
+                       size_t hash)
+{
+  if (!filter_may_contain (HASHMAP_BLOCK (hash_map), hash))
+    return NULL;
+  const vector *bucket = hash_map->buckets[hash & (hash_map->capacity - 1)];
+  for (size_t i = 0; i < bucket_size (bucket); i++)
+    {
+      pair *curr = bucket_at (bucket, i);
+      if (str_key_equals (curr->key, key, len, hash))
+        return curr;
+    }
+  return NULL;
+}
+
+/**
+ * Adds a byte string key with a value to the hash map.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key.
+ * @param len number of bytes.
+ * @param value the value of the key.
+ * @param take 1 if the hash map takes ownership of the value, 0 if it
+ * stores a copy of it.
+ * @return returns 1 for successful insertion, 0 otherwise.
+ */
+static int insert_str (hashmap *hash_map, const char *key, size_t len,
+                       const_valueT value, pair_value_cpy value_cpy,
+                       pair_value_cmp value_cmp, pair_value_free value_free,
+                       int take)
+{
+  if (hash_map == NULL || HASHMAP_BLOCK (hash_map)->str_keys == NULL
+      || (key == NULL && len != 0) || value == NULL || value_cpy == NULL)
+    return 0;
+  size_t hash = str_hash (key, len);
+  if (find_str (hash_map, key, len, hash) != NULL)
+    return 0;
+  const str_key *interned = str_arena_add (HASHMAP_BLOCK (hash_map)->str_keys,
+                                           key, len, hash);
+  if (interned == NULL)
+    return 0;
+  pair *in_pair = entry_alloc (interned, value, str_key_cpy,
+                               take ? adopt_value : value_cpy, str_key_cmp,
+                               value_cmp, str_key_free, value_free);
+  if (in_pair == NULL)
+    return 0;
+  in_pair->value_cpy = value_cpy;
+  if (!place_pair (hash_map, in_pair))
+    {
+      if (take)
+        in_pair->value_free = forget_value;
+      void *elem = in_pair;
+      entry_release (&elem);
+      return 0;
+    }
+  return 1;
+}
+
+/**
+ * Inserts a byte string key with a copy of the value to the hash map.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key, need not be NUL terminated.
+ * @param len number of bytes.
+ * @param value the value of the key.
+ * @param value_cpy function which copies the value.
+ * @param value_cmp function which compares values.
+ * @param value_free function which frees the value.
+ * @return returns 1 for successful insertion, 0 otherwise.
+ */
+int hashmap_insert_str (hashmap *hash_map, const char *key, size_t len,
+                        const_valueT value, pair_value_cpy value_cpy,
+                        pair_value_cmp value_cmp, pair_value_free value_free)
+{
+  return insert_str (hash_map, key, len, value, value_cpy, value_cmp,
+                     value_free, 0);
+}
+
+/**
+ * Inserts a byte string key with the caller's value to the hash map,
+ * without copying the value. On success the hash map takes ownership of
+ * the value and frees it with value_free.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key, need not be NUL terminated.
+ * @param len number of bytes.
+ * @param value a dynamically allocated value.
+ * @param value_cpy function which copies the value (used when the pair
+ * is copied).
+ * @param value_cmp function which compares values.
+ * @param value_free function which frees the value.
+ * @return returns 1 for successful insertion, 0 otherwise (the value then
+ * still belongs to the caller).
+ */
+int hashmap_insert_str_take (hashmap *hash_map, const char *key, size_t len,
+                             valueT value, pair_value_cpy value_cpy,
+                             pair_value_cmp value_cmp,
+                             pair_value_free value_free)
+{
+  return insert_str (hash_map, key, len, value, value_cpy, value_cmp,
+                     value_free, 1);
+}
+
+/**
+ * The function returns the value associated with the given byte string
+ * key, which is borrowed and not copied.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key, need not be NUL terminated.
+ * @param len number of bytes.
+ * @return the value associated with key if exists, NULL otherwise
+ * (the value itself, not a copy of it).
+ */
+valueT hashmap_at_str (const hashmap *hash_map, const char *key, size_t len)
+{
+  if (hash_map == NULL || HASHMAP_BLOCK (hash_map)->str_keys == NULL
+      || (key == NULL && len != 0))
+    return NULL;
+  pair *found = find_str (hash_map, key, len, str_hash (key, len));
+  return (found == NULL) ? NULL : found->value;
+}
+
+/**
+ * The function erases the pair associated with the byte string key.
+ * The bytes of the key stay in the arena until the map is freed.
+ * @param hash_map a hash map of byte string keys.
+ * @param key the bytes of the key, need not be NUL terminated.
+ * @param len number of bytes.
+ * @return 1 if the erasing was done successfully, 0 otherwise.
+ */
+int hashmap_erase_str (hashmap *hash_map, const char *key, size_t len)
+{
+  if (hash_map == NULL || HASHMAP_BLOCK (hash_map)->str_keys == NULL
+      || (key == NULL && len != 0))
+    return 0;
+  pair *found = find_str (hash_map, key, len, str_hash (key, len));
+  return (found == NULL) ? 0 : hashmap_erase (hash_map, found->key);
+}
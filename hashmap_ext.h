@@ -0,0 +1,106 @@
+#ifndef HASHMAP_EXT_H_
+#define HASHMAP_EXT_H_
+
+#include "hashmap.h"
+#include "allocator.h"
+
+typedef int (*pair_visit) (const pair *elem, void *ctx);
+
+/**
+ * Allocates dynamically new hash map element, whose bucket table and
+ * vectors come from the given allocator (NULL for std_allocator).
+ */
+hashmap *hashmap_alloc_ex (hash_func func, const allocator *alloc);
+
+/**
+ * Allocates a hash map which shares the buckets and pairs of the given map,
+ * in O(buckets) time.
+ * A shared bucket is copied by whichever map mutates it first; the copy
+ * shares the pairs, which are only copied to modify a shared value.
+ */
+hashmap *hashmap_clone_cow (const hashmap *hash_map);
+
+/**
+ * Inserts the caller's pair to the hash map without copying it, and sets
+ * *p_pair to NULL.
+ */
+int hashmap_insert_take (hashmap *hash_map, pair **p_pair);
+
+/**
+ * Inserts a pair of copies of key and value, built once inside the hash
+ * map.
+ */
+int hashmap_emplace (hashmap *hash_map, const_keyT key, const_valueT value,
+                     pair_key_cpy key_cpy, pair_value_cpy value_cpy,
+                     pair_key_cmp key_cmp, pair_value_cmp value_cmp,
+                     pair_key_free key_free, pair_value_free value_free);
+
+/**
+ * Removes the pair associated with key and hands it to the caller. The key
+ * of a pair taken from a hashmap_alloc_str map stays in the map's arena and
+ * dangles after hashmap_free.
+ */
+pair *hashmap_erase_take (hashmap *hash_map, const_keyT key);
+
+/**
+ * Puts a Bloom filter of bits_per_bucket bits per bucket in front of the
+ * hash map (0 removes it), so most lookups of missing keys return early.
+ */
+int hashmap_set_filter (hashmap *hash_map, size_t bits_per_bucket);
+
+/**
+ * This function returns the memory taken by the filter of the hash map.
+ */
+size_t hashmap_filter_size (const hashmap *hash_map);
+
+/**
+ * Allocates dynamically new hash map element whose keys are byte strings,
+ * kept in an append-only arena of the map.
+ */
+hashmap *hashmap_alloc_str (const allocator *alloc);
+
+/**
+ * Inserts a byte string key with a copy of the value to the hash map.
+ */
+int hashmap_insert_str (hashmap *hash_map, const char *key, size_t len,
+                        const_valueT value, pair_value_cpy value_cpy,
+                        pair_value_cmp value_cmp, pair_value_free value_free);
+
+/**
+ * Inserts a byte string key with the caller's value to the hash map, which
+ * takes ownership of the value instead of copying it.
+ */
+int hashmap_insert_str_take (hashmap *hash_map, const char *key, size_t len,
+                             valueT value, pair_value_cpy value_cpy,
+                             pair_value_cmp value_cmp,
+                             pair_value_free value_free);
+
+/**
+ * The function returns the value associated with the borrowed byte string
+ * key.
+ */
+valueT hashmap_at_str (const hashmap *hash_map, const char *key, size_t len);
+
+/**
+ * The function erases the pair associated with the byte string key.
+ */
+int hashmap_erase_str (hashmap *hash_map, const char *key, size_t len);
+
+/**
+ * Moves all the pairs of the hash map to a new table of new_capacity
+ * buckets (a power of 2), using nthreads threads.
+ */
+int hashmap_rehash (hashmap *hash_map, size_t new_capacity, size_t nthreads);
+
+/**
+ * Sets the number of threads which grow and shrink the table of the hash
+ * map.
+ */
+int hashmap_set_rehash_threads (hashmap *hash_map, size_t nthreads);
+
+/**
+ * Calls a function on every pair of the hash map, until it returns 0.
+ */
+int hashmap_for_each (const hashmap *hash_map, pair_visit visit, void *ctx);
+
+#endif // HASHMAP_EXT_H_
@@ -0,0 +1,253 @@
+#include <stdint.h>
+#include <string.h>
+#include "str_key.h"
+
+#define STR_ARENA_CHUNK_SIZE (64UL << 10)
+#define STR_HASH_MUL_1 0x9e3779b97f4a7c15UL
+#define STR_HASH_MUL_2 0xc2b2ae3d27d4eb4fUL
+
+/**
+ * A chunk of the arena. Records are appended to data until it is full.
+ */
+typedef struct str_chunk
+{
+  struct str_chunk *next;
+  size_t used;
+  size_t capacity;
+  size_t data[];
+} str_chunk;
+
+struct str_arena
+{
+  size_t refs;
+  const allocator *alloc;
+  str_chunk *chunks;
+  struct str_arena *parent;
+};
+
+/**
+ * Loads 8 bytes which may be unaligned.
+ */
+static uint64_t load_word (const char *ptr)
+{
+  uint64_t word;
+  memcpy (&word, ptr, sizeof (word));
+  return word;
+}
+
+/**
+ * Folds a word into a hash lane.
+ */
+static uint64_t hash_round (uint64_t lane, uint64_t word)
+{
+  lane ^= word * STR_HASH_MUL_2;
+  lane = (lane << 31) | (lane >> 33);
+  return lane * STR_HASH_MUL_1;
+}
+
+/**
+ * Hashes a byte string. Long strings are consumed 32 bytes at a time in
+ * four independent lanes, so the multiplications of the lanes overlap.
+ * @param str the bytes to hash, need not be NUL terminated.
+ * @param len number of bytes.
+ * @return the hash, all of whose bits depend on every byte.
+ */
+size_t str_hash (const char *str, size_t len)
+{
+  uint64_t lanes[4] = {len, STR_HASH_MUL_1, STR_HASH_MUL_2,
+                       STR_HASH_MUL_1 ^ STR_HASH_MUL_2};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    for (int lane = 0; lane < 4; lane++)
+      lanes[lane] = hash_round (lanes[lane], load_word (str + i + 8 * lane));
+  uint64_t hash = lanes[0] ^ (lanes[1] >> 1) ^ (lanes[2] >> 2)
+                  ^ (lanes[3] >> 3);
+  for (; i + 8 <= len; i += 8)
+    hash = hash_round (hash, load_word (str + i));
+  if (i < len)
+    {
+      uint64_t tail = 0;
+      memcpy (&tail, str + i, len - i);
+      hash = hash_round (hash, tail);
+    }
+  hash ^= hash >> 33;
+  hash *= STR_HASH_MUL_2;
+  hash ^= hash >> 29;
+  return (size_t) hash;
+}
+
+/**
+ * Dynamically allocates an empty arena.
+ * @param alloc the allocator of the arena, must outlive it.
+ * NULL for std_allocator.
+ * @return pointer to dynamically allocated arena.
+ * @if_fail return NULL.
+ */
+str_arena *str_arena_alloc (const allocator *alloc)
+{
+  if (alloc == NULL)
+    alloc = &std_allocator;
+  str_arena *arena = (str_arena *) alloc->alloc (sizeof (str_arena),
+                                                 alloc->ctx);
+  if (arena == NULL)
+    return NULL;
+  arena->refs = 1;
+  arena->alloc = alloc;
+  arena->chunks = NULL;
+  arena->parent = NULL;
+  return arena;
+}
+
+/**
+ * Dynamically allocates an empty arena which keeps the given arena, and
+ * so its keys, alive. Each of them is then appended to by a single owner,
+ * so a hash map and its clone may add keys on different threads.
+ * @param parent an arena.
+ * @return pointer to dynamically allocated arena.
+ * @if_fail return NULL.
+ */
+str_arena *str_arena_fork (str_arena *parent)
+{
+  if (parent == NULL)
+    return NULL;
+  str_arena *arena = str_arena_alloc (parent->alloc);
+  if (arena != NULL)
+    arena->parent = str_arena_share (parent);
+  return arena;
+}
+
+/**
+ * Adds an owner to the arena. The arena stays alive until every owner
+ * called str_arena_free on it.
+ * @param arena an arena.
+ * @return the same arena.
+ */
+str_arena *str_arena_share (str_arena *arena)
+{
+  if (arena != NULL)
+    __atomic_add_fetch (&arena->refs, 1, __ATOMIC_RELAXED);
+  return arena;
+}
+
+/**
+ * Drops the caller's reference to the arena. The last owner frees it
+ * together with all its keys, and drops its reference to its parent.
+ * @param p_arena pointer to dynamically allocated pointer to arena.
+ */
+void str_arena_free (str_arena **p_arena)
+{
+  if (p_arena == NULL || *p_arena == NULL)
+    return;
+  str_arena *arena = *p_arena;
+  *p_arena = NULL;
+  while (arena != NULL
+         && __atomic_sub_fetch (&arena->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      const allocator *alloc = arena->alloc;
+      while (arena->chunks != NULL)
+        {
+          str_chunk *next = arena->chunks->next;
+          alloc->free (arena->chunks,
+                       sizeof (str_chunk)
+                       + arena->chunks->capacity * sizeof (size_t),
+                       alloc->ctx);
+          arena->chunks = next;
+        }
+      str_arena *parent = arena->parent;
+      alloc->free (arena, sizeof (str_arena), alloc->ctx);
+      arena = parent;
+    }
+}
+
+/**
+ * Copies a byte string with its hash to the end of the arena.
+ * Strings longer than a chunk get a chunk of their own. Not thread safe;
+ * an arena has a single owner which adds keys, see str_arena_fork.
+ * @param arena an arena.
+ * @param str the bytes of the key, need not be NUL terminated.
+ * @param len number of bytes.
+ * @param hash str_hash of the bytes.
+ * @return the new key, NULL if the allocation failed.
+ */
+const str_key *str_arena_add (str_arena *arena, const char *str, size_t len,
+                              size_t hash)
+{
+  if (arena == NULL || (str == NULL && len != 0))
+    return NULL;
+  size_t words = (sizeof (str_key) + len + sizeof (size_t) - 1)
+                 / sizeof (size_t);
+  str_chunk *chunk = arena->chunks;
+  if (chunk == NULL || chunk->capacity - chunk->used < words)
+    {
+      size_t capacity = STR_ARENA_CHUNK_SIZE / sizeof (size_t);
+      if (capacity < words)
+        capacity = words;
+      chunk = (str_chunk *) arena->alloc->alloc
+          (sizeof (str_chunk) + capacity * sizeof (size_t), arena->alloc->ctx);
+      if (chunk == NULL)
+        return NULL;
+      chunk->used = 0;
+      chunk->capacity = capacity;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+    }
+  str_key *key = (str_key *) (chunk->data + chunk->used);
+  chunk->used += words;
+  key->hash = hash;
+  key->len = len;
+  if (len != 0)
+    memcpy (key->bytes, str, len);
+  return key;
+}
+
+/**
+ * Checks whether a key holds the given byte string. The bytes are only
+ * compared when the hashes and lengths match.
+ * @param key a key.
+ * @param str the bytes to compare.
+ * @param len number of bytes.
+ * @param hash str_hash of the bytes.
+ * @return 1 if they are equal, 0 otherwise.
+ */
+int str_key_equals (const str_key *key, const char *str, size_t len,
+                    size_t hash)
+{
+  return key->hash == hash && key->len == len
+         && memcmp (key->bytes, str, len) == 0;
+}
+
+/**
+ * Hash map hash_func of str_key keys, returns the stored hash.
+ */
+size_t str_key_hash (const void *key)
+{
+  return ((const str_key *) key)->hash;
+}
+
+/**
+ * Compares two str_key keys.
+ * @return 1 if they hold the same bytes, 0 otherwise.
+ */
+int str_key_cmp (const void *key_1, const void *key_2)
+{
+  const str_key *key = key_2;
+  return key_1 == key_2
+         || str_key_equals (key_1, key->bytes, key->len, key->hash);
+}
+
+/**
+ * The arena owns the keys, so a copy is the key itself.
+ */
+void *str_key_cpy (const void *key)
+{
+  return (void *) key;
+}
+
+/**
+ * The arena owns the keys, so freeing a key only forgets it.
+ */
+void str_key_free (void **key)
+{
+  if (key != NULL)
+    *key = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef STR_KEY_H_
+#define STR_KEY_H_
+
+#include <stdlib.h>
+#include "allocator.h"
+
+/**
+ * A byte string key. Keys live in a str_arena and are never copied or freed
+ * on their own; their address identifies them for as long as the arena
+ * lives.
+ */
+typedef struct str_key
+{
+  size_t hash;
+  size_t len;
+  char bytes[];
+} str_key;
+
+/**
+ * Append-only pool of str_key records, allocated in chunks which never
+ * move. Owned by a hash map; its clones keep it alive to read its keys.
+ */
+typedef struct str_arena str_arena;
+
+/**
+ * Hashes a byte string 8 bytes at a time.
+ */
+size_t str_hash (const char *str, size_t len);
+
+/**
+ * Dynamically allocates an empty arena (alloc NULL for std_allocator).
+ */
+str_arena *str_arena_alloc (const allocator *alloc);
+
+/**
+ * Adds an owner to the arena.
+ */
+str_arena *str_arena_share (str_arena *arena);
+
+/**
+ * Dynamically allocates an empty arena for new keys, which keeps the keys
+ * of the given arena alive.
+ */
+str_arena *str_arena_fork (str_arena *parent);
+
+/**
+ * Drops the caller's reference to the arena, freeing it with all its keys
+ * on the last one.
+ */
+void str_arena_free (str_arena **p_arena);
+
+/**
+ * Copies a byte string with its hash to the arena.
+ */
+const str_key *str_arena_add (str_arena *arena, const char *str, size_t len,
+                              size_t hash);
+
+/**
+ * Checks whether a key holds the given byte string.
+ */
+int str_key_equals (const str_key *key, const char *str, size_t len,
+                    size_t hash);
+
+/**
+ * Callbacks making str_key records usable as hash map keys.
+ */
+size_t str_key_hash (const void *key);
+int str_key_cmp (const void *key_1, const void *key_2);
+void *str_key_cpy (const void *key);
+void str_key_free (void **key);
+
+#endif // STR_KEY_H_
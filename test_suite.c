@@ -1,5 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "test_suite.h"
+#include "hashmap_ext.h"
+#include "diskmap.h"
+#include "cvector.h"
 #include "test_pairs.h"
 #include "hash_funcs.h"
 
@@ -278,3 +287,718 @@ void test_hash_map_apply_if ()
   free_pair_lst (pair_lst);
 }
 
+/**
+ * Number of ints copied by counted_int_cpy.
+ */
+static size_t int_copies = 0;
+
+/**
+ * Copies an int key or value, counting the copies.
+ */
+static void *counted_int_cpy (const void *elem)
+{
+  int_copies++;
+  return int_value_cpy (elem);
+}
+
+/**
+ * This function checks the hashmap_clone_cow function of the hashmap library.
+ * The clone and the original map must not see each other's changes, and
+ * mutating or growing either one must not copy the pairs they share.
+ * If hashmap_clone_cow fails at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_hash_map_clone_cow (void)
+{
+  hashmap *t = hashmap_alloc (hash_char);
+  void **pair_lst = make_pairs ();
+  for (int i = 0; i < PAIRS_LST_SIZE - 1; i++)
+    hashmap_insert (t, pair_lst[i]);
+
+  hashmap *clone = hashmap_clone_cow (t);
+  assert (clone != NULL);
+  assert (clone->size == t->size && clone->capacity == t->capacity);
+
+  // Changes of the original map are not seen by the clone.
+  pair *first = pair_lst[0];
+  int erased = hashmap_erase (t, first->key);
+  assert (erased == 1);
+  assert (hashmap_at (t, first->key) == NULL);
+  assert (*(int *) hashmap_at (clone, first->key) == 0);
+
+  // Changes of the clone are not seen by the original map.
+  pair *last = pair_lst[PAIRS_LST_SIZE - 1];
+  int pushed = hashmap_insert (clone, last);
+  assert (pushed == 1);
+  assert (hashmap_at (t, last->key) == NULL);
+  int counts = hashmap_apply_if (clone, is_digit, double_value);
+  assert (counts == 10);
+  for (int i = 16; i < 26; i++)
+    {
+      pair *curr = pair_lst[i];
+      assert (*(int *) hashmap_at (clone, curr->key) == 2 * i);
+      assert (*(int *) hashmap_at (t, curr->key) == i);
+    }
+
+  hashmap_free (&t);
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      pair *curr = pair_lst[i];
+      assert (hashmap_at (clone, curr->key) != NULL);
+    }
+  hashmap_free (&clone);
+  free_pair_lst (pair_lst);
+
+  // Keys 4 apart fall in a quarter of the buckets, most of them in pairs.
+  t = hashmap_alloc (hash_int);
+  for (int i = 0; i < 1000; i++)
+    {
+      int key = 4 * i;
+      pushed = hashmap_emplace (t, &key, &key, counted_int_cpy,
+                                counted_int_cpy, int_value_cmp, int_value_cmp,
+                                int_value_free, int_value_free);
+      assert (pushed == 1);
+    }
+  int_copies = 0;
+  clone = hashmap_clone_cow (t);
+  assert (clone != NULL);
+  size_t clone_copies = int_copies;
+  assert (clone_copies == 0);
+  size_t capacity = clone->capacity;
+  for (int i = 0; i < 1000; i++)
+    {
+      int key = 4 * i + 1;
+      pushed = hashmap_emplace (clone, &key, &key, counted_int_cpy,
+                                counted_int_cpy, int_value_cmp, int_value_cmp,
+                                int_value_free, int_value_free);
+      assert (pushed == 1);
+    }
+  // Growing copied the shared buckets, but only the new pairs were copied.
+  assert (capacity < clone->capacity);
+  assert (int_copies == clone_copies + 2 * 1000);
+  for (int i = 0; i < 1000; i += 2)
+    {
+      int key = 4 * i;
+      erased = hashmap_erase (t, &key);
+      assert (erased == 1);
+    }
+  assert (int_copies == clone_copies + 2 * 1000);
+  for (int i = 0; i < 1000; i++)
+    {
+      int key = 4 * i;
+      assert (*(int *) hashmap_at (clone, &key) == key);
+      assert ((hashmap_at (t, &key) == NULL) == (i % 2 == 0));
+    }
+  hashmap_free (&t);
+  assert (clone->size == 2000);
+  hashmap_free (&clone);
+}
+
+/**
+ * Allocator which counts the bytes it has handed out and not got back.
+ */
+static void *counting_alloc (size_t size, void *ctx)
+{
+  *(size_t *) ctx += size;
+  return malloc (size);
+}
+
+/**
+ * Resizes a block of counting_alloc.
+ */
+static void *counting_realloc (void *ptr, size_t old_size,
+                               size_t new_size, void *ctx)
+{
+  void *new_ptr = realloc (ptr, new_size);
+  if (new_ptr != NULL)
+    *(size_t *) ctx += new_size - old_size;
+  return new_ptr;
+}
+
+/**
+ * Frees a block of counting_alloc.
+ */
+static void counting_free (void *ptr, size_t size, void *ctx)
+{
+  *(size_t *) ctx -= size;
+  free (ptr);
+}
+
+/**
+ * This function checks the hashmap_alloc_ex function of the hashmap library.
+ * All the memory of the map must come from its allocator and return to it.
+ * If hashmap_alloc_ex fails at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_hash_map_alloc_ex (void)
+{
+  size_t in_use = 0;
+  allocator counting = {counting_alloc, counting_realloc, counting_free,
+                        &in_use, NULL};
+  hashmap *t = hashmap_alloc_ex (hash_char, &counting);
+  assert (t != NULL);
+  size_t empty_in_use = in_use;
+  assert (empty_in_use >= START_CAPACITY * sizeof (vector *));
+
+  void **pair_lst = make_pairs ();
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    hashmap_insert (t, pair_lst[i]);
+  assert (empty_in_use < in_use);
+
+  // Clones and the vectors they copy use the same allocator.
+  hashmap *clone = hashmap_clone_cow (t);
+  int counts = hashmap_apply_if (clone, is_digit, double_value);
+  assert (counts == 10);
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      pair *curr = pair_lst[i];
+      hashmap_erase (t, curr->key);
+    }
+  hashmap_free (&clone);
+  hashmap_free (&t);
+  assert (in_use == 0);
+  free_pair_lst (pair_lst);
+}
+
+/**
+ * This function checks the hashmap_set_filter function of the hashmap
+ * library. The filter must never hide a key which is in the map.
+ * If hashmap_set_filter fails at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_hash_map_set_filter (void)
+{
+  hashmap *t = hashmap_alloc (hash_char);
+  void **pair_lst = make_pairs ();
+  assert (hashmap_filter_size (t) == 0);
+  int filter_set = hashmap_set_filter (t, 8);
+  assert (filter_set == 1);
+  assert (hashmap_filter_size (t) > 0);
+
+  // The filter follows insertions and the growth of the table.
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      hashmap_insert (t, pair_lst[i]);
+      for (int j = 0; j <= i; j++)
+        {
+          pair *curr = pair_lst[j];
+          assert (*(int *) hashmap_at (t, curr->key) == j);
+        }
+    }
+  char name = (char) 80;
+  assert (hashmap_at (t, &name) == NULL);
+
+  // And erasures and the shrinking of the table.
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      pair *curr = pair_lst[i];
+      int erased = hashmap_erase (t, curr->key);
+      assert (erased == 1);
+      assert (hashmap_at (t, curr->key) == NULL);
+      for (int j = i + 1; j < PAIRS_LST_SIZE; j++)
+        {
+          curr = pair_lst[j];
+          assert (*(int *) hashmap_at (t, curr->key) == j);
+        }
+    }
+
+  filter_set = hashmap_set_filter (t, 0);
+  assert (filter_set == 1);
+  assert (hashmap_filter_size (t) == 0);
+  free_pair_lst (pair_lst);
+  hashmap_free (&t);
+}
+
+/**
+ * This function checks the byte string key functions of the hashmap library.
+ * Keys are looked up through slices of a larger buffer, so they are not
+ * NUL terminated.
+ * If the byte string key functions fail at some points, the functions exits
+ * with exit code != 0.
+ */
+void test_hash_map_str_keys (void)
+{
+  const char *text = "http://a.io/http://b.io/http://c.io/index.html";
+  const size_t lens[] = {12, 12, 12, 10, 0};
+  hashmap *t = hashmap_alloc_str (NULL);
+  assert (t != NULL);
+
+  size_t offset = 0;
+  for (int i = 0; i < 5; i++)
+    {
+      int pushed = hashmap_insert_str (t, text + offset, lens[i], &i,
+                                       int_value_cpy, int_value_cmp,
+                                       int_value_free);
+      assert (pushed == 1);
+      offset += lens[i];
+    }
+  assert (t->size == 5);
+  int pushed = hashmap_insert_str (t, "http://b.io/", 12, &offset,
+                                   int_value_cpy, int_value_cmp,
+                                   int_value_free);
+  assert (pushed == 0);
+
+  // Many keys, longer than the 32 bytes hashed at once.
+  char long_key[64];
+  memset (long_key, 'x', sizeof (long_key));
+  for (int i = 0; i < 100; i++)
+    {
+      long_key[i % 64] = (char) ('a' + i / 64);
+      pushed = hashmap_insert_str (t, long_key, 40 + i % 24, &i,
+                                   int_value_cpy, int_value_cmp,
+                                   int_value_free);
+      assert (pushed == 1);
+    }
+  assert (t->size == 105);
+
+  assert (*(int *) hashmap_at_str (t, "http://c.io/", 12) == 2);
+  assert (*(int *) hashmap_at_str (t, text + 36, 10) == 3);
+  assert (*(int *) hashmap_at_str (t, "", 0) == 4);
+  assert (hashmap_at_str (t, "http://c.io", 11) == NULL);
+
+  // The map keeps the value it takes, the caller keeps the one it rejects.
+  int taken = 7;
+  void *owned = int_value_cpy (&taken);
+  pushed = hashmap_insert_str_take (t, "taken", 5, owned, int_value_cpy,
+                                    int_value_cmp, int_value_free);
+  assert (pushed == 1 && hashmap_at_str (t, "taken", 5) == owned);
+  owned = int_value_cpy (&taken);
+  pushed = hashmap_insert_str_take (t, "taken", 5, owned, int_value_cpy,
+                                    int_value_cmp, int_value_free);
+  assert (pushed == 0);
+  int_value_free (&owned);
+
+  // The clone and the map add their new keys to arenas of their own.
+  hashmap *clone = hashmap_clone_cow (t);
+  int extra = 105;
+  int erased = hashmap_erase_str (t, "http://a.io/", 12);
+  assert (erased == 1);
+  erased = hashmap_erase_str (t, "http://a.io/", 12);
+  assert (erased == 0);
+  assert (hashmap_at_str (t, text, 12) == NULL);
+  pushed = hashmap_insert_str (t, "only in t", 9, &extra, int_value_cpy,
+                               int_value_cmp, int_value_free);
+  assert (pushed == 1);
+  pushed = hashmap_insert_str (clone, "only in clone", 13, &extra,
+                               int_value_cpy, int_value_cmp, int_value_free);
+  assert (pushed == 1);
+  assert (hashmap_at_str (t, "only in clone", 13) == NULL);
+  assert (hashmap_at_str (clone, "only in t", 9) == NULL);
+  hashmap_free (&t);
+  assert (*(int *) hashmap_at_str (clone, text, 12) == 0);
+  assert (*(int *) hashmap_at_str (clone, "only in clone", 13) == extra);
+  hashmap_free (&clone);
+}
+
+/**
+ * Allocator whose blocks never grow or shrink, like an allocator out of
+ * memory.
+ */
+static void *failing_realloc (void *ptr, size_t old_size, size_t new_size,
+                              void *ctx)
+{
+  (void) ptr;
+  (void) old_size;
+  (void) new_size;
+  (void) ctx;
+  return NULL;
+}
+
+/**
+ * This function checks buckets going from one pair to several and back.
+ * 'A', 'Q' and 'a' fall in the same bucket of the initial table.
+ * If it fails at some points, the functions exits with exit code != 0.
+ */
+void test_hash_map_bucket_collisions (void)
+{
+  hashmap *t = hashmap_alloc (hash_char);
+  const char names[] = {'A', 'Q', 'a'};
+  for (int i = 0; i < 3; i++)
+    {
+      pair *in_pair = pair_alloc (&names[i], &i, char_key_cpy, int_value_cpy,
+                                  char_key_cmp, int_value_cmp, char_key_free,
+                                  int_value_free);
+      int pushed = hashmap_insert (t, in_pair);
+      assert (pushed == 1);
+      void *to_free = in_pair;
+      pair_free (&to_free);
+      for (int j = 0; j <= i; j++)
+        assert (*(int *) hashmap_at (t, &names[j]) == j);
+    }
+  assert (t->capacity == START_CAPACITY);
+
+  int erased = hashmap_erase (t, &names[1]);
+  assert (erased == 1);
+  assert (hashmap_at (t, &names[1]) == NULL);
+  assert (*(int *) hashmap_at (t, &names[0]) == 0);
+  assert (*(int *) hashmap_at (t, &names[2]) == 2);
+
+  // Cloning copies the inline bucket left, and leaves the map as it was.
+  vector *buckets[START_CAPACITY];
+  size_t table_size = t->capacity * sizeof (vector *);
+  assert (table_size <= sizeof (buckets));
+  memcpy (buckets, t->buckets, table_size);
+  hashmap *clone = hashmap_clone_cow (t);
+  assert (clone != NULL);
+  assert (memcmp (buckets, t->buckets, table_size) == 0);
+  hashmap_free (&clone);
+
+  erased = hashmap_erase (t, &names[0]);
+  assert (erased == 1);
+  assert (*(int *) hashmap_at (t, &names[2]) == 2);
+  erased = hashmap_erase (t, &names[0]);
+  assert (erased == 0);
+  erased = hashmap_erase (t, &names[2]);
+  assert (erased == 1);
+  assert (t->size == 0);
+  hashmap_free (&t);
+
+  // A bucket of two pairs goes back inline without resizing its vector.
+  size_t in_use = 0;
+  allocator no_realloc = {counting_alloc, failing_realloc, counting_free,
+                          &in_use, NULL};
+  t = hashmap_alloc_ex (hash_char, &no_realloc);
+  for (int i = 0; i < 2; i++)
+    {
+      int pushed = hashmap_emplace (t, &names[i], &i, char_key_cpy,
+                                    int_value_cpy, char_key_cmp,
+                                    int_value_cmp, char_key_free,
+                                    int_value_free);
+      assert (pushed == 1);
+    }
+  erased = hashmap_erase (t, &names[1]);
+  assert (erased == 1);
+  assert (t->size == 1);
+  assert (*(int *) hashmap_at (t, &names[0]) == 0);
+  hashmap_free (&t);
+  assert (in_use == 0);
+}
+
+/**
+ * This function checks the hashmap_rehash function of the hashmap library,
+ * with several threads even though the table is small.
+ * If hashmap_rehash fails at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_hash_map_rehash (void)
+{
+  hashmap *t = hashmap_alloc (hash_char);
+  void **pair_lst = make_pairs ();
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    hashmap_insert (t, pair_lst[i]);
+  hashmap *clone = hashmap_clone_cow (t);
+
+  int rehashed = hashmap_rehash (t, 100, 4);
+  assert (rehashed == 0);
+  rehashed = hashmap_rehash (t, 256, 0);
+  assert (rehashed == 0);
+  rehashed = hashmap_rehash (t, 256, 4);
+  assert (rehashed == 1);
+  assert (t->capacity == 256 && t->size == PAIRS_LST_SIZE);
+  rehashed = hashmap_rehash (t, 32, 3);
+  assert (rehashed == 1);
+  assert (t->capacity == 32);
+  // No more threads than buckets are started.
+  rehashed = hashmap_rehash (t, 16, 1000);
+  assert (rehashed == 1);
+  rehashed = hashmap_rehash (t, 32, 1000);
+  assert (rehashed == 1);
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      pair *curr = pair_lst[i];
+      assert (*(int *) hashmap_at (t, curr->key) == i);
+      assert (*(int *) hashmap_at (clone, curr->key) == i);
+    }
+
+  // Automatic shrinking of the rehashed table.
+  int threads_set = hashmap_set_rehash_threads (t, 4);
+  assert (threads_set == 1);
+  for (int i = 0; i < PAIRS_LST_SIZE; i++)
+    {
+      pair *curr = pair_lst[i];
+      int erased = hashmap_erase (t, curr->key);
+      assert (erased == 1);
+    }
+  assert (t->size == 0);
+  assert (clone->size == PAIRS_LST_SIZE);
+  hashmap_free (&t);
+  hashmap_free (&clone);
+  free_pair_lst (pair_lst);
+}
+
+/**
+ * Counts the keys diskmap_at_batch found with their expected value.
+ */
+void count_batch_hit (size_t ind, const void *value, size_t value_len,
+                      void *ctx)
+{
+  if (value != NULL && value_len == sizeof (size_t)
+      && *(const size_t *) value == ind * 3)
+    (*(size_t *) ctx)++;
+}
+
+/**
+ * Makes every partition file in dir unreadable, keeping its name. Each
+ * file is replaced by a record header whose bytes are missing: one with
+ * plausible lengths, or one with lengths which overflow an allocation.
+ * @return number of files replaced.
+ */
+static size_t corrupt_partitions (const char *dir, size_t npartitions)
+{
+  const size_t headers[][2] = {{1000, 1000}, {1, SIZE_MAX - 7},
+                               {SIZE_MAX, 1}};
+  size_t corrupted = 0;
+  for (size_t p = 0; p < npartitions; p++)
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "%s/part-%zu", dir, p);
+      FILE *file = fopen (path, "rb");
+      if (file == NULL)
+        continue;
+      fclose (file);
+      file = fopen (path, "wb");
+      assert (file != NULL);
+      size_t written = fwrite (headers[corrupted % 3], sizeof (size_t), 2,
+                               file);
+      int closed = fclose (file);
+      assert (written == 2 && closed == 0);
+      corrupted++;
+    }
+  return corrupted;
+}
+
+/**
+ * This function checks the diskmap functions of the hashmap library, with
+ * a memory budget which holds a few partitions only. The partition files
+ * are written to a temporary directory, which is corrupted at the end so
+ * that lookups fail.
+ * If the diskmap functions fail at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_diskmap (void)
+{
+  char dir[] = "diskmap-test-XXXXXX";
+  char *made = mkdtemp (dir);
+  assert (made != NULL);
+  diskmap *map = diskmap_alloc (dir, 8, 2000);
+  assert (map != NULL);
+  char keys[200][8];
+  const char *key_ptrs[200];
+  size_t key_lens[200];
+  for (size_t i = 0; i < 200; i++)
+    {
+      size_t value = i * 3;
+      key_lens[i] = (size_t) sprintf (keys[i], "k%zu", i);
+      key_ptrs[i] = keys[i];
+      int inserted = diskmap_insert (map, keys[i], key_lens[i], &value,
+                                     sizeof (value));
+      assert (inserted == 1);
+      assert (diskmap_resident_size (map) <= 2000 + 200 * 20);
+    }
+  assert (diskmap_size (map) == 200);
+  int inserted = diskmap_insert (map, "k7", 2, "x", 1);
+  assert (inserted == 0);
+
+  // Every lookup may read its partition back from disk.
+  const void *value = NULL;
+  for (size_t i = 0; i < 200; i++)
+    {
+      size_t value_len = 0;
+      int found = diskmap_at (map, keys[i], key_lens[i], &value, &value_len);
+      assert (found == 1 && value_len == sizeof (size_t));
+      assert (*(const size_t *) value == i * 3);
+    }
+  int found = diskmap_at (map, "k200", 4, &value, NULL);
+  assert (found == 0 && value == NULL);
+
+  int erased = diskmap_erase (map, "k5", 2);
+  assert (erased == 1);
+  erased = diskmap_erase (map, "k5", 2);
+  assert (erased == 0);
+  found = diskmap_at (map, "k5", 2, &value, NULL);
+  assert (found == 0);
+
+  size_t hits = 0;
+  long batch_found = diskmap_at_batch (map, key_ptrs, key_lens, 200,
+                                       count_batch_hit, &hits);
+  assert (batch_found == 199);
+  assert (hits == 199);
+
+  // k5 was erased, k6 is still in the map.
+  const void *values[] = {"a", "b", "c"};
+  size_t value_lens[] = {1, 1, 1};
+  long batch_inserted = diskmap_insert_batch (map, key_ptrs + 4,
+                                              key_lens + 4, values,
+                                              value_lens, 3);
+  assert (batch_inserted == 1);
+  found = diskmap_at (map, "k5", 2, &value, NULL);
+  assert (found == 1 && *(const char *) value == 'b');
+  assert (diskmap_size (map) == 200);
+
+  // A partition which cannot be read back is a failure, not a missing key.
+  assert (corrupt_partitions (dir, 8) != 0);
+  size_t failed = 0;
+  for (size_t i = 0; i < 200; i++)
+    {
+      found = diskmap_at (map, keys[i], key_lens[i], &value, NULL);
+      assert (found != 0);
+      failed += found == -1;
+      erased = diskmap_erase (map, keys[i], key_lens[i]);
+      assert (erased == found);
+    }
+  assert (failed != 0);
+  diskmap_free (&map);
+  int removed = rmdir (dir);
+  assert (removed == 0);
+}
+
+/**
+ * This function checks the hashmap_insert_take, hashmap_emplace and
+ * hashmap_erase_take functions of the hashmap library, which move pairs in
+ * and out of the map without copying them.
+ * If the functions fail at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_hash_map_insert_take (void)
+{
+  hashmap *t = hashmap_alloc (hash_char);
+  const char names[] = {'A', 'Q', 'a', 'b'};
+  int values[] = {0, 1, 2, 3};
+  pair *in_pair = pair_alloc (&names[0], &values[0], char_key_cpy,
+                              int_value_cpy, char_key_cmp, int_value_cmp,
+                              char_key_free, int_value_free);
+  valueT taken = in_pair->value;
+  int pushed = hashmap_insert_take (t, &in_pair);
+  assert (pushed == 1);
+  assert (in_pair == NULL);
+  assert (hashmap_at (t, &names[0]) == taken);
+
+  pair *dup = pair_alloc (&names[0], &values[1], char_key_cpy, int_value_cpy,
+                          char_key_cmp, int_value_cmp, char_key_free,
+                          int_value_free);
+  pair *kept = dup;
+  pushed = hashmap_insert_take (t, &dup);
+  assert (pushed == 0);
+  assert (dup == kept);
+  void *to_free = dup;
+  pair_free (&to_free);
+  pushed = hashmap_insert_take (t, NULL);
+  assert (pushed == 0);
+
+  for (int i = 1; i < 4; i++)
+    {
+      pushed = hashmap_emplace (t, &names[i], &values[i], char_key_cpy,
+                                int_value_cpy, char_key_cmp, int_value_cmp,
+                                char_key_free, int_value_free);
+      assert (pushed == 1);
+    }
+  pushed = hashmap_emplace (t, &names[2], &values[0], char_key_cpy,
+                            int_value_cpy, char_key_cmp, int_value_cmp,
+                            char_key_free, int_value_free);
+  assert (pushed == 0);
+  assert (t->size == 4);
+  for (int i = 0; i < 4; i++)
+    assert (*(int *) hashmap_at (t, &names[i]) == i);
+
+  // 'A', 'Q' and 'a' share a bucket, which goes inline once one is left.
+  for (int i = 0; i < 4; i++)
+    {
+      pair *out = hashmap_erase_take (t, &names[i]);
+      assert (out != NULL);
+      assert (*(char *) out->key == names[i] && *(int *) out->value == i);
+      assert (hashmap_at (t, &names[i]) == NULL);
+      pair *again = hashmap_erase_take (t, &names[i]);
+      assert (again == NULL);
+      for (int j = i + 1; j < 4; j++)
+        assert (*(int *) hashmap_at (t, &names[j]) == j);
+      to_free = out;
+      pair_free (&to_free);
+    }
+  assert (t->size == 0);
+  hashmap_free (&t);
+}
+
+#define CVECTOR_THREADS 4
+#define CVECTOR_PUSHES 5000
+
+/**
+ * The ints which one thread of test_cvector pushes, and the vector they go
+ * to.
+ */
+typedef struct push_job
+{
+  cvector *vec;
+  int start;
+} push_job;
+
+/**
+ * This function checks that the ints [start, start + CVECTOR_PUSHES) can
+ * be pushed to a cvector shared with other threads. It is run by each of
+ * the threads of test_cvector.
+ * If a push fails, the functions exits with exit code != 0.
+ */
+void *push_ints (void *arg)
+{
+  push_job *job = arg;
+  for (int i = job->start; i < job->start + CVECTOR_PUSHES; i++)
+    {
+      int pushed = cvector_push_back (job->vec, &i);
+      assert (pushed == 1);
+    }
+  return NULL;
+}
+
+/**
+ * This function checks the cvector functions of the hashmap library: its
+ * elements are read while several threads push to it, and every pushed
+ * int is found exactly once when they are done.
+ * If the cvector functions fail at some points, the functions exits with
+ * exit code != 0.
+ */
+void test_cvector (void)
+{
+  cvector *vec = cvector_alloc (int_value_cpy, int_value_free, NULL);
+  assert (vec != NULL && cvector_size (vec) == 0);
+  assert (cvector_at (vec, 0) == NULL);
+
+  pthread_t threads[CVECTOR_THREADS];
+  push_job jobs[CVECTOR_THREADS];
+  for (int t = 0; t < CVECTOR_THREADS; t++)
+    {
+      jobs[t].vec = vec;
+      jobs[t].start = t * CVECTOR_PUSHES;
+      int created = pthread_create (&threads[t], NULL, push_ints, &jobs[t]);
+      assert (created == 0);
+    }
+  // Read while the producers push; a pushed element never moves.
+  size_t seen = 0;
+  while (seen < CVECTOR_THREADS * CVECTOR_PUSHES)
+    {
+      size_t size = cvector_size (vec);
+      for (size_t i = 0; i < size; i++)
+        {
+          int *elem = cvector_at (vec, i);
+          assert (elem == NULL || *elem < CVECTOR_THREADS * CVECTOR_PUSHES);
+        }
+      seen = size;
+    }
+  for (int t = 0; t < CVECTOR_THREADS; t++)
+    {
+      int joined = pthread_join (threads[t], NULL);
+      assert (joined == 0);
+    }
+
+  assert (cvector_size (vec) == CVECTOR_THREADS * CVECTOR_PUSHES);
+  char found[CVECTOR_THREADS * CVECTOR_PUSHES] = {0};
+  for (size_t i = 0; i < cvector_size (vec); i++)
+    {
+      int *elem = cvector_at (vec, i);
+      assert (elem != NULL && found[*elem] == 0);
+      found[*elem] = 1;
+    }
+  assert (cvector_at (vec, CVECTOR_THREADS * CVECTOR_PUSHES) == NULL);
+  int pushed = cvector_push_back (vec, NULL);
+  assert (pushed == 0);
+  cvector_free (&vec);
+  assert (vec == NULL);
+}
@@ -1,4 +1,20 @@
-#include "vector.h"
+#include <stddef.h>
+#include "vector_ext.h"
+
+/**
+ * Every vector is allocated inside a block which also counts its owners,
+ * so a vector can be shared between hash maps and copied on write, and
+ * remembers the allocator its memory comes from.
+ */
+typedef struct vector_block
+{
+  size_t refs;
+  const allocator *alloc;
+  vector vec;
+} vector_block;
+
+#define VECTOR_BLOCK(v) \
+  ((vector_block *) ((char *) (v) - offsetof (vector_block, vec)))
 
 /**
  * Dynamically allocates a new vector.
@@ -13,22 +29,50 @@
 vector *
 vector_alloc (vector_elem_cpy elem_copy_func, vector_elem_cmp elem_cmp_func,
               vector_elem_free elem_free_func)
+{
+  return vector_alloc_ex (elem_copy_func, elem_cmp_func, elem_free_func,
+                          NULL);
+}
+
+/**
+ * Dynamically allocates a new vector whose memory comes from the given
+ * allocator.
+ * @param elem_copy_func func which copies the element stored in
+ * the vector (returns dynamically allocated copy).
+ * @param elem_cmp_func func which is used to compare elements stored
+ * in the vector.
+ * @param elem_free_func func which frees elements stored in the vector.
+ * @param alloc the allocator of the vector and its data array, must outlive
+ * the vector. NULL for std_allocator.
+ * @return pointer to dynamically allocated vector.
+ * @if_fail return NULL.
+ */
+vector *
+vector_alloc_ex (vector_elem_cpy elem_copy_func, vector_elem_cmp elem_cmp_func,
+                 vector_elem_free elem_free_func, const allocator *alloc)
 {
   if (elem_copy_func == NULL || elem_cmp_func == NULL
       || elem_free_func == NULL)
     return NULL;
-  vector *v = (vector *) malloc (sizeof (vector));
-  if (v == NULL)
+  if (alloc == NULL)
+    alloc = &std_allocator;
+  vector_block *block = (vector_block *) alloc->alloc
+      (sizeof (vector_block), alloc->ctx);
+  if (block == NULL)
     return NULL;
+  block->refs = 1;
+  block->alloc = alloc;
+  vector *v = &block->vec;
 
   v->capacity = VECTOR_INITIAL_CAP;
   v->size = 0;
 
-  v->data = (void **) malloc (sizeof (void *) * v->capacity);
+  v->data = (void **) alloc->alloc (sizeof (void *) * v->capacity,
+                                    alloc->ctx);
   if (v->data == NULL)
     {
-      free (v);
-      v = NULL;
+      alloc->free (block, sizeof (vector_block), alloc->ctx);
+      block = NULL;
       return NULL;
     }
 
@@ -40,17 +84,26 @@ vector_alloc (vector_elem_cpy elem_copy_func, vector_elem_cmp elem_cmp_func,
 
 /**
  * Frees a vector and the elements the vector itself allocated.
+ * If the vector is shared, only drops the caller's reference to it.
  * @param p_vector pointer to dynamically allocated pointer to vector.
  */
 void vector_free (vector **p_vector)
 {
   if ((p_vector == NULL) || (*p_vector == NULL))
     return;
+  if (__atomic_sub_fetch (&VECTOR_BLOCK (*p_vector)->refs, 1,
+                          __ATOMIC_ACQ_REL) != 0)
+    {
+      *p_vector = NULL;
+      return;
+    }
   for (size_t i = 0; i < (*p_vector)->size; i++)
     if ((*p_vector)->data[i] != NULL)
       (*p_vector)->elem_free_func (&(*p_vector)->data[i]);
-  free ((*p_vector)->data);
-  free (*p_vector);
+  const allocator *alloc = VECTOR_BLOCK (*p_vector)->alloc;
+  alloc->free ((*p_vector)->data, sizeof (void *) * (*p_vector)->capacity,
+               alloc->ctx);
+  alloc->free (VECTOR_BLOCK (*p_vector), sizeof (vector_block), alloc->ctx);
   *p_vector = NULL;
 }
 
@@ -99,11 +152,38 @@ int vector_push_back (vector *vector, const void *value)
 {
   if (vector == NULL || vector->data == NULL || value == NULL)
     return 0;
+  void *copy = vector->elem_copy_func (value);
+  if (copy == NULL)
+    return 0;
+  if (!vector_push_back_take (vector, copy))
+    {
+      vector->elem_free_func (&copy);
+      return 0;
+    }
+  return 1;
+}
+
+/**
+ * Adds an element to the back (index vector_size) of the vector without
+ * copying it. The vector takes ownership of the element.
+ * @param vector a pointer to vector.
+ * @param elem the element to be added to the vector.
+ * @return 1 if the adding has been done successfully, 0 otherwise (the
+ * element then still belongs to the caller).
+ */
+int vector_push_back_take (vector *vector, void *elem)
+{
+  if (vector == NULL || vector->data == NULL || elem == NULL)
+    return 0;
   vector->size++;
   if (VECTOR_MAX_LOAD_FACTOR < vector_get_load_factor (vector))
     {
+      const allocator *alloc = VECTOR_BLOCK (vector)->alloc;
       vector->capacity *= VECTOR_GROWTH_FACTOR;
-      void **temp = realloc (vector->data, sizeof (void *) * vector->capacity);
+      void **temp = alloc->realloc
+          (vector->data,
+           sizeof (void *) * vector->capacity / VECTOR_GROWTH_FACTOR,
+           sizeof (void *) * vector->capacity, alloc->ctx);
       if (temp == NULL)
         {
           vector->capacity /= VECTOR_GROWTH_FACTOR;
@@ -112,7 +192,7 @@ int vector_push_back (vector *vector, const void *value)
         }
       vector->data = temp;
     }
-  vector->data[vector->size - 1] = vector->elem_copy_func (value);
+  vector->data[vector->size - 1] = elem;
   return 1;
 }
 
@@ -137,30 +217,48 @@ double vector_get_load_factor (const vector *vector)
  * @return 1 if the removing has been done successfully, 0 otherwise.
  */
 int vector_erase (vector *vector, size_t ind)
+{
+  void *elem = vector_take (vector, ind);
+  if (elem == NULL)
+    return 0;
+  vector->elem_free_func (&elem);
+  return 1;
+}
+
+/**
+ * Removes the element at the given index from the vector without freeing
+ * it, like vector_erase. The caller takes ownership of the element.
+ * @param vector a pointer to vector.
+ * @param ind the index of the element to be removed.
+ * @return the removed element, NULL if the removing failed.
+ */
+void *vector_take (vector *vector, size_t ind)
 {
   if (vector == NULL || vector->data == NULL || vector->size <= ind
       || vector->size == 0 || vector_at (vector, ind) == NULL)
-    return 0;
+    return NULL;
   vector->size--;
-  if (vector_get_load_factor (vector) < VECTOR_MIN_LOAD_FACTOR)
+  if (vector_get_load_factor (vector) < VECTOR_MIN_LOAD_FACTOR
+      && VECTOR_GROWTH_FACTOR <= vector->capacity)
     {
-      void **temp_data = realloc (vector->data,
-                                  sizeof (void *) * vector->capacity
-                                  / VECTOR_GROWTH_FACTOR);
+      const allocator *alloc = VECTOR_BLOCK (vector)->alloc;
+      void **temp_data = alloc->realloc
+          (vector->data, sizeof (void *) * vector->capacity,
+           sizeof (void *) * vector->capacity / VECTOR_GROWTH_FACTOR,
+           alloc->ctx);
       if (temp_data == NULL)
         {
           vector->size++;
-          return 0;
+          return NULL;
         }
       vector->data = temp_data;
       vector->capacity /= VECTOR_GROWTH_FACTOR;
     }
-  vector->elem_free_func (vector->data + ind);
-  vector->data[ind] = NULL;
+  void *elem = vector->data[ind];
   for (size_t i = ind; i < vector->size; i++)
     vector->data[i] = vector->data[i + 1];
   vector->data[vector->size] = NULL;
-  return 1;
+  return elem;
 }
 
 /**
@@ -174,4 +272,53 @@ void vector_clear (vector *vector)
   vector->size = 0;
 }
 
+/**
+ * Adds an owner to the vector. The vector stays alive until every owner
+ * called vector_free on it.
+ * @param vector a pointer to vector.
+ * @return the same vector, NULL if vector is NULL.
+ */
+vector *vector_share (vector *vector)
+{
+  if (vector == NULL)
+    return NULL;
+  __atomic_add_fetch (&VECTOR_BLOCK (vector)->refs, 1, __ATOMIC_RELAXED);
+  return vector;
+}
+
+/**
+ * Checks whether the vector has more than one owner.
+ * @param vector a pointer to vector.
+ * @return 1 if the vector is shared, 0 otherwise.
+ */
+int vector_is_shared (const vector *vector)
+{
+  if (vector == NULL)
+    return 0;
+  return __atomic_load_n (&VECTOR_BLOCK (vector)->refs, __ATOMIC_ACQUIRE) > 1;
+}
 
+/**
+ * Dynamically allocates a new vector holding copies of the elements of the
+ * given vector.
+ * @param orig a pointer to vector.
+ * @return pointer to dynamically allocated copy of the vector.
+ * @if_fail return NULL.
+ */
+vector *vector_copy (const vector *orig)
+{
+  if (orig == NULL)
+    return NULL;
+  vector *copy = vector_alloc_ex (orig->elem_copy_func, orig->elem_cmp_func,
+                                  orig->elem_free_func,
+                                  VECTOR_BLOCK (orig)->alloc);
+  if (copy == NULL)
+    return NULL;
+  for (size_t i = 0; i < orig->size; i++)
+    if (!vector_push_back (copy, orig->data[i]))
+      {
+        vector_free (&copy);
+        return NULL;
+      }
+  return copy;
+}
@@ -0,0 +1,44 @@
+#ifndef VECTOR_EXT_H_
+#define VECTOR_EXT_H_
+
+#include "vector.h"
+#include "allocator.h"
+
+/**
+ * Dynamically allocates a new vector whose memory comes from the given
+ * allocator (NULL for std_allocator).
+ */
+vector *
+vector_alloc_ex (vector_elem_cpy elem_copy_func, vector_elem_cmp elem_cmp_func,
+                 vector_elem_free elem_free_func, const allocator *alloc);
+
+/**
+ * Adds an owner to the vector. The vector stays alive until every owner
+ * called vector_free on it.
+ */
+vector *vector_share (vector *vector);
+
+/**
+ * Checks whether the vector has more than one owner.
+ */
+int vector_is_shared (const vector *vector);
+
+/**
+ * Dynamically allocates a new vector holding copies of the elements of the
+ * given vector.
+ */
+vector *vector_copy (const vector *orig);
+
+/**
+ * Adds an element to the back of the vector without copying it.
+ * The vector takes ownership of the element.
+ */
+int vector_push_back_take (vector *vector, void *elem);
+
+/**
+ * Removes the element at the given index from the vector without freeing
+ * it. The caller takes ownership of the element.
+ */
+void *vector_take (vector *vector, size_t ind);
+
+#endif // VECTOR_EXT_H_